@@ -0,0 +1,177 @@
+/*
+ * bufpool.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "bufpool.h"
+#include "log.h"
+
+// Pool of reference counted RX buffers shared by all devices. Every
+// RX transfer is resubmitted with a fresh buffer from the pool before
+// the received one is processed; the transfer owns nothing after that.
+// The USB layer drops its reference once the data was handed to the
+// mux layer, which takes its own for buffers it keeps for reassembly.
+
+// buffers come in power of two sizes from BUFPOOL_MIN_SIZE up
+#define BUFPOOL_MIN_SHIFT 12
+#define BUFPOOL_CLASSES 5
+// free buffers kept per size class, the rest is given back
+#define BUFPOOL_MAX_FREE 64
+// buffer data is cache line aligned, the header sits right in front
+#define BUFPOOL_ALIGN 64
+
+struct bufpool_hdr {
+	struct bufpool_hdr *next;	// free list
+	int refcount;
+	int cls;
+};
+
+struct bufpool_class {
+	struct bufpool_hdr *free;
+	int free_count;
+	uint64_t allocated;	// buffers of this class currently in existence
+};
+
+static struct bufpool_class classes[BUFPOOL_CLASSES];
+static mutex_t bufpool_mutex;
+static uint64_t bufpool_hits, bufpool_misses;
+
+#define BUF_HDR(buf) ((struct bufpool_hdr *)((unsigned char *)(buf) - BUFPOOL_ALIGN))
+#define HDR_BUF(hdr) ((unsigned char *)(hdr) + BUFPOOL_ALIGN)
+
+void bufpool_init(void)
+{
+	memset(classes, 0, sizeof(classes));
+	bufpool_hits = 0;
+	bufpool_misses = 0;
+	mutex_init(&bufpool_mutex);
+}
+
+void bufpool_shutdown(void)
+{
+	int i;
+	mutex_lock(&bufpool_mutex);
+	for(i = 0; i < BUFPOOL_CLASSES; i++) {
+		while(classes[i].free) {
+			struct bufpool_hdr *hdr = classes[i].free;
+			classes[i].free = hdr->next;
+			free(hdr);
+		}
+		classes[i].free_count = 0;
+	}
+	mutex_unlock(&bufpool_mutex);
+	mutex_destroy(&bufpool_mutex);
+}
+
+/**
+ * Get a buffer of at least size bytes with a reference count of 1.
+ *
+ * @param size Number of bytes needed, at most 64 KB.
+ * @return The buffer, or NULL if out of memory.
+ */
+unsigned char *bufpool_get(uint32_t size)
+{
+	struct bufpool_hdr *hdr;
+	int cls = 0;
+	while(cls < BUFPOOL_CLASSES - 1 && (1U << (BUFPOOL_MIN_SHIFT + cls)) < size)
+		cls++;
+	if((1U << (BUFPOOL_MIN_SHIFT + cls)) < size) {
+		usbmuxd_log(LL_ERROR, "%s: buffer size %u is too large", __func__, size);
+		return NULL;
+	}
+
+	mutex_lock(&bufpool_mutex);
+	hdr = classes[cls].free;
+	if(hdr) {
+		classes[cls].free = hdr->next;
+		classes[cls].free_count--;
+		bufpool_hits++;
+	} else {
+		bufpool_misses++;
+	}
+	mutex_unlock(&bufpool_mutex);
+
+	if(!hdr) {
+		if(posix_memalign((void**)&hdr, BUFPOOL_ALIGN, BUFPOOL_ALIGN + (1U << (BUFPOOL_MIN_SHIFT + cls))))
+			return NULL;
+		hdr->cls = cls;
+		mutex_lock(&bufpool_mutex);
+		classes[cls].allocated++;
+		mutex_unlock(&bufpool_mutex);
+	}
+	hdr->next = NULL;
+	hdr->refcount = 1;
+	return HDR_BUF(hdr);
+}
+
+void bufpool_ref(unsigned char *buf)
+{
+	__atomic_add_fetch(&BUF_HDR(buf)->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference to a buffer. The last one returns it to the pool.
+ */
+void bufpool_put(unsigned char *buf)
+{
+	struct bufpool_hdr *hdr;
+	if(!buf)
+		return;
+	hdr = BUF_HDR(buf);
+	if(__atomic_sub_fetch(&hdr->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	mutex_lock(&bufpool_mutex);
+	if(classes[hdr->cls].free_count < BUFPOOL_MAX_FREE) {
+		hdr->next = classes[hdr->cls].free;
+		classes[hdr->cls].free = hdr;
+		classes[hdr->cls].free_count++;
+		hdr = NULL;
+	} else {
+		classes[hdr->cls].allocated--;
+	}
+	mutex_unlock(&bufpool_mutex);
+	free(hdr);
+}
+
+plist_t bufpool_get_stats(void)
+{
+	int i;
+	plist_t dict = plist_new_dict();
+	plist_t sizes = plist_new_array();
+	mutex_lock(&bufpool_mutex);
+	for(i = 0; i < BUFPOOL_CLASSES; i++) {
+		if(!classes[i].allocated)
+			continue;
+		plist_t c = plist_new_dict();
+		plist_dict_set_item(c, "Size", plist_new_uint(1U << (BUFPOOL_MIN_SHIFT + i)));
+		plist_dict_set_item(c, "Allocated", plist_new_uint(classes[i].allocated));
+		plist_dict_set_item(c, "Free", plist_new_uint(classes[i].free_count));
+		plist_array_append_item(sizes, c);
+	}
+	plist_dict_set_item(dict, "Hits", plist_new_uint(bufpool_hits));
+	plist_dict_set_item(dict, "Misses", plist_new_uint(bufpool_misses));
+	mutex_unlock(&bufpool_mutex);
+	plist_dict_set_item(dict, "Buffers", sizes);
+	return dict;
+}
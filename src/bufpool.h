@@ -0,0 +1,31 @@
+/*
+ * bufpool.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+void bufpool_init(void);
+void bufpool_shutdown(void);
+unsigned char *bufpool_get(uint32_t size);
+void bufpool_ref(unsigned char *buf);
+void bufpool_put(unsigned char *buf);
+plist_t bufpool_get_stats(void);
+
+#endif
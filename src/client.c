@@ -46,6 +46,7 @@
 #include "client.h"
 #include "device.h"
 #include "conf.h"
+#include "bufpool.h"
 
 #define CMD_BUF_SIZE	0x10000
 #define REPLY_BUF_SIZE	0x10000
@@ -74,6 +75,7 @@ struct mux_client {
 	uint32_t proto_version;
 	uint32_t number;
 	plist_t info;
+	int close_pending;
 };
 
 static struct collection client_list;
@@ -251,22 +253,12 @@ int client_accept(int listenfd)
 	return client->fd;
 }
 
-void client_close(struct mux_client *client)
+/**
+ * Release a client's resources. The caller has to hold client_list_mutex
+ * and take care of removing the client from client_list.
+ */
+static void client_free(struct mux_client *client)
 {
-	int found = 0;
-	mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *lc, &client_list) {
-		if (client == lc) {
-			found = 1;
-			break;
-		}
-	} ENDFOREACH
-	if (!found) {
-		// in case we get called again but client was already freed
-		usbmuxd_log(LL_DEBUG, "%s: ignoring for non-existing client %p", __func__, client);
-		mutex_unlock(&client_list_mutex);
-		return;
-	}
 #ifdef SO_PEERCRED
 	if (log_level >= LL_INFO) {
 		struct ucred cr;
@@ -293,10 +285,43 @@ void client_close(struct mux_client *client)
 	free(client->ob_buf);
 	free(client->ib_buf);
 	plist_free(client->info);
+	free(client);
+}
 
+void client_close(struct mux_client *client)
+{
+	int found = 0;
+	mutex_lock(&client_list_mutex);
+	FOREACH(struct mux_client *lc, &client_list) {
+		if (client == lc) {
+			found = 1;
+			break;
+		}
+	} ENDFOREACH
+	if (!found) {
+		// in case we get called again but client was already freed
+		usbmuxd_log(LL_DEBUG, "%s: ignoring for non-existing client %p", __func__, client);
+		mutex_unlock(&client_list_mutex);
+		return;
+	}
 	collection_remove(&client_list, client);
+	client_free(client);
 	mutex_unlock(&client_list_mutex);
-	free(client);
+}
+
+/**
+ * Mark a client to be closed by the next call to client_device_remove().
+ * Used while tearing down all connections of a removed device so the
+ * client list is only walked once, no matter how many connections the
+ * device had. Nothing else closes marked clients, so this must only be
+ * called from device_remove(), which calls client_device_remove()
+ * right after.
+ *
+ * @param client The client to close.
+ */
+void client_close_deferred(struct mux_client *client)
+{
+	client->close_pending = 1;
 }
 
 void client_get_fds(struct fdlist *list)
@@ -437,6 +462,17 @@ static int send_device_list(struct mux_client *client, uint32_t tag)
 	return res;
 }
 
+static int send_device_stats(struct mux_client *client, uint32_t tag)
+{
+	int res = -1;
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "DeviceStats", device_get_stats());
+	plist_dict_set_item(dict, "RxBufferPool", bufpool_get_stats());
+	res = send_plist(client, tag, dict);
+	plist_free(dict);
+	return res;
+}
+
 static int send_listener_list(struct mux_client *client, uint32_t tag)
 {
 	int res = -1;
@@ -726,14 +762,15 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 					plist_free(dict);
 
 					usbmuxd_log(LL_DEBUG, "Client %d requesting connection to device %d port %d", client->fd, device_id, ntohs(portnum));
+					// a pooled connection completes right away, so be ready for it
+					client->connect_tag = hdr->tag;
+					client->connect_device = device_id;
+					client->state = CLIENT_CONNECTING1;
 					res = device_start_connect(device_id, ntohs(portnum), client);
 					if(res < 0) {
+						client->state = CLIENT_COMMAND;
 						if (send_result(client, hdr->tag, -res) < 0)
 							return -1;
-					} else {
-						client->connect_tag = hdr->tag;
-						client->connect_device = device_id;
-						client->state = CLIENT_CONNECTING1;
 					}
 					return 0;
 				} else if (!strcmp(message, "ListDevices")) {
@@ -742,6 +779,12 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 					if (send_device_list(client, hdr->tag) < 0)
 						return -1;
 					return 0;
+				} else if (!strcmp(message, "ListDeviceStats")) {
+					free(message);
+					plist_free(dict);
+					if (send_device_stats(client, hdr->tag) < 0)
+						return -1;
+					return 0;
 				} else if (!strcmp(message, "ListListeners")) {
 					free(message);
 					plist_free(dict);
@@ -854,14 +897,14 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 		case MESSAGE_CONNECT:
 			ch = (void*)hdr;
 			usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, ch->device_id, ntohs(ch->port));
+			client->connect_tag = hdr->tag;
+			client->connect_device = ch->device_id;
+			client->state = CLIENT_CONNECTING1;
 			res = device_start_connect(ch->device_id, ntohs(ch->port), client);
 			if(res < 0) {
+				client->state = CLIENT_COMMAND;
 				if(send_result(client, hdr->tag, -res) < 0)
 					return -1;
-			} else {
-				client->connect_tag = hdr->tag;
-				client->connect_device = ch->device_id;
-				client->state = CLIENT_CONNECTING1;
 			}
 			return 0;
 		default:
@@ -1001,9 +1044,17 @@ void client_device_remove(int device_id)
 	mutex_lock(&client_list_mutex);
 	uint32_t id = device_id;
 	usbmuxd_log(LL_DEBUG, "client_device_remove: id %d", device_id);
+	// close the clients of the device's connections (see
+	// client_close_deferred) and notify the listeners in one pass
+	// over the list; collection_remove() searches it once more for
+	// each closed client, which only happens on device removal
 	FOREACH(struct mux_client *client, &client_list) {
-		if(client->state == CLIENT_LISTEN)
+		if(client->close_pending) {
+			collection_remove(&client_list, client);
+			client_free(client);
+		} else if(client->state == CLIENT_LISTEN) {
 			send_device_remove(client, id);
+		}
 	} ENDFOREACH
 	mutex_unlock(&client_list_mutex);
 }
@@ -31,6 +31,7 @@ int client_read(struct mux_client *client, void *buffer, uint32_t len);
 int client_write(struct mux_client *client, void *buffer, uint32_t len);
 int client_set_events(struct mux_client *client, short events);
 void client_close(struct mux_client *client);
+void client_close_deferred(struct mux_client *client);
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result);
 
 void client_device_add(struct device_info *dev);
@@ -26,6 +26,7 @@
 #endif
 
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdlib.h>
@@ -33,7 +34,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
 
+#include <plist/plist.h>
 #include <libimobiledevice-glue/collection.h>
 #include <libimobiledevice-glue/thread.h>
 
@@ -42,16 +45,71 @@
 #include "preflight.h"
 #include "usb.h"
 #include "log.h"
+#include "bufpool.h"
+#include "ratelimit.h"
+#include "drr.h"
 
 int next_device_id;
 
 #define DEV_MRU 65536
+// number of USB transfers a mux packet of DEV_MRU bytes can be split into
+#define DEV_RX_FRAGS ((DEV_MRU + USB_MRU_MIN - 1) / USB_MRU_MIN + 1)
 
+// connection buffers start at CONN_BUF_MIN bytes and grow up to these
 #define CONN_INBUF_SIZE		262144
 #define CONN_OUTBUF_SIZE	65536
+#define CONN_BUF_MIN		4096
+// shrink buffers of connections without traffic for this many ms
+#define CONN_BUF_IDLE		10000
+
+// connections are allocated from per-device slabs of this many objects
+#define CONN_SLAB_OBJS 16
+// at most this many free objects keep their buffers for reuse
+#define CONN_FREE_BUFS CONN_SLAB_OBJS
+#define CACHELINE_SIZE 64
 
 #define ACK_TIMEOUT 30
 
+// give up flushing a dead connection's buffer to the client after this
+// many milliseconds without progress
+#define LINGER_TIMEOUT 1000
+
+// limits for the adaptive per-device cap on bytes queued in USB and the
+// transfer completion latency it aims for (in us)
+#define TX_LIMIT_MIN (2 * USB_MTU)
+#define TX_LIMIT_MAX (1024 * 1024)
+#define TX_LIMIT_DEFAULT (4 * USB_MTU)
+#define TX_TARGET_LATENCY 4000
+
+// packing of small packets into one USB transfer: packets below
+// PACK_SMALL bytes are collected, and the probe sent when a device
+// comes up must be answered within PACK_PROBE_TIMEOUT ms
+#define PACK_SMALL 1024
+#define PACK_PROBE_TIMEOUT 1000
+// the probe uses source ports PACK_PROBE_SPORT and PACK_PROBE_SPORT + 1,
+// find_sport() never hands them out
+#define PACK_PROBE_SPORT 0xfff0
+#define PACK_PROBE_DPORT 1
+
+// milliseconds to wait before replacing a pooled connection that failed;
+// doubled up to POOL_RETRY_MAX while the device keeps refusing the port
+#define POOL_RETRY 1000
+#define POOL_RETRY_MAX 60000
+
+// default flush threshold for coalesced client writes
+#define COALESCE_SIZE 1024
+
+// bytes a connection of weight 1 may send per TX scheduler round
+#define TX_QUANTUM 49152
+
+// priority classes, 0 is served first; connections default to CONN_PRIO_DEFAULT
+#define CONN_PRIO_COUNT 3
+#define CONN_PRIO_DEFAULT 1
+
+// USB queue classes: 0 for control packets and ACKs, then one per
+// connection priority class
+#define TX_PRIO_COUNT (CONN_PRIO_COUNT + 1)
+
 enum mux_protocol {
 	MUX_PROTO_VERSION = 0,
 	MUX_PROTO_CONTROL = 1,
@@ -65,12 +123,19 @@ enum mux_dev_state {
 	MUXDEV_DEAD		// dead
 };
 
+enum mux_pack_state {
+	PACK_OFF,		// one packet per transfer
+	PACK_PROBING,	// waiting for the answers to the probe
+	PACK_ON			// small packets are collected into one transfer
+};
+
 enum mux_conn_state {
 	CONN_CONNECTING,	// SYN
 	CONN_CONNECTED,		// SYN/SYNACK/ACK -> active
 	CONN_REFUSED,		// RST received during SYN
 	CONN_DYING,			// RST received
-	CONN_DEAD			// being freed; used to prevent infinite recursion between client<->device freeing
+	CONN_DEAD,			// being freed; used to prevent infinite recursion between client<->device freeing
+	CONN_LINGER			// detached from the device, flushing the remaining data to the client
 };
 
 struct mux_header
@@ -92,25 +157,84 @@ struct version_header
 struct mux_device;
 
 #define CONN_ACK_PENDING 1
+#define CONN_TX_READY 2
+#define CONN_THROTTLED_UP 4
+#define CONN_THROTTLED_DOWN 8
 
 struct mux_connection
 {
-	struct mux_device *dev;
-	struct mux_client *client;
-	enum mux_conn_state state;
+	// hot fields, used for every packet and every connection scan;
+	// keep these within the first cache line
 	uint16_t sport, dport;
+	enum mux_conn_state state;
+	int flags;
+	short events;
+	int priority;
 	uint32_t tx_seq, tx_ack, tx_acked, tx_win;
 	uint32_t rx_seq, rx_recvd, rx_ack, rx_win;
-	uint32_t max_payload;
 	uint32_t sendable;
-	int flags;
-	unsigned char *ib_buf;
 	uint32_t ib_size;
-	uint32_t ib_capacity;
+	uint32_t ob_size;
+	// buffers and owners
+	struct mux_device *dev;
+	struct mux_client *client;
+	unsigned char *ib_buf;
 	unsigned char *ob_buf;
+	uint32_t ib_capacity;
 	uint32_t ob_capacity;
-	short events;
+	uint32_t max_payload;
+	uint32_t tx_queued;	// bytes waiting in the device's TX queue
 	uint64_t last_ack_time;
+	uint64_t last_activity;	// ms, last time data went in either direction
+	// cold fields: scheduling parameters, timers and setup
+	struct drr_flow drr;
+	uint32_t coalesce_delay;
+	uint64_t coalesce_deadline;
+	struct token_bucket rate_up;
+	struct token_bucket rate_down;
+	uint64_t throttle_deadline;
+	uint64_t linger_deadline;
+	uint64_t connect_start;
+	uint64_t connect_deadline;
+	int pooled;	// idle connection waiting for a client
+	uint32_t idle_timeout;	// ms, 0 if the connection is never reaped
+	// mux and TCP header with the fields that never change filled in
+	unsigned char tx_hdr[sizeof(struct mux_header) + sizeof(struct tcphdr)];
+	int tx_hdr_len;
+	struct mux_connection *next_free;	// free list of the device's slabs
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+// a block of connection objects owned by one device
+struct conn_slab
+{
+	struct conn_slab *next;
+	struct mux_connection conns[CONN_SLAB_OBJS];
+};
+
+// packet waiting for room in the device's USB pipe
+struct tx_packet
+{
+	struct tx_packet *next;
+	struct mux_connection *conn;
+	unsigned char *buf;
+	uint32_t length;
+};
+
+// connection statistics for one port of a device
+struct port_stats
+{
+	uint16_t port;
+	uint64_t connects;
+	uint64_t refused;
+	uint64_t timeouts;
+	uint64_t syn_latency_total;	// SYN -> SYN/ACK, in us
+	uint32_t syn_latency_min;
+	uint32_t syn_latency_max;
+	uint64_t refused_until;	// connects fail right away until then (ms)
+	uint64_t refused_hits;
+	uint64_t pool_hits;
+	uint32_t pool_backoff;	// ms, 0 while pooled connects succeed
+	uint64_t pool_retry_at;	// no pooled connects before then (ms)
 };
 
 struct mux_device
@@ -121,43 +245,252 @@ struct mux_device
 	int visible;
 	struct collection connections;
 	uint16_t next_sport;
-	unsigned char *pktbuf;
+	struct iovec rx_frags[DEV_RX_FRAGS];	// RX buffers of a split packet
+	int rx_frag_count;
 	uint32_t pktlen;
 	void *preflight_cb_data;
 	int version;
 	uint16_t rx_seq;
 	uint16_t tx_seq;
+	int tx_next;
+	uint64_t next_check;	// ms, no connection deadline before then
+	struct token_bucket rate_up;
+	struct token_bucket rate_down;
+	struct collection port_stats;
+	uint64_t pool_refill_time;	// ms, 0 if the pool is full
+	uint64_t reaped_conns;
+	uint64_t reaped_bytes;
+	struct tx_packet *txq_head[TX_PRIO_COUNT];
+	struct tx_packet *txq_tail[TX_PRIO_COUNT];
+	uint32_t tx_queued;	// bytes in the TX queues
+	uint32_t tx_inflight;	// bytes submitted to USB and not completed yet
+	uint32_t tx_limit;
+	uint64_t tx_latency;	// average completion latency in us
+	enum mux_pack_state pack_state;
+	uint64_t pack_probe_deadline;
+	int pack_probe_seen;
+	unsigned char *pack_buf;
+	uint32_t pack_len;
+	int pack_count;
+	uint64_t packed_packets;
+	uint64_t packed_transfers;
+	struct conn_slab *conn_slabs;
+	struct mux_connection *conn_free;
+	int conn_free_bufs;	// free objects that still have buffers
+	uint64_t slab_mem;	// bytes in connection slabs, kept until the device goes
+	uint64_t buf_mem;	// bytes in connection buffers, including cached ones
 };
 
 static struct collection device_list;
 mutex_t device_list_mutex;
 
-static struct mux_device* get_mux_device_for_id(int device_id)
+/**
+ * Read-mostly copy of device_list. Lookups take the current snapshot
+ * without locking; device_list itself and the snapshots are only
+ * changed under device_list_mutex when devices come and go. Replaced
+ * snapshots and removed devices are retired and freed once no reader
+ * is left that could still be looking at them.
+ */
+struct device_registry {
+	int count;
+	struct mux_device *devs[];
+};
+
+static struct device_registry *device_registry;
+static int registry_readers;
+static struct collection registry_retired;
+static struct collection registry_retired_devs;
+static int registry_retired_count;
+
+// dead connections still flushing data to their clients
+static struct collection linger_list;
+
+static uint32_t coalesce_delay;
+static uint32_t coalesce_size;
+static struct port_map coalesce_ports;
+
+static struct port_map tx_weights;
+static uint32_t tx_max_inflight;
+
+static struct port_map port_priorities;
+
+static uint32_t connect_timeout;
+static uint32_t refused_cache_ttl;
+
+// ports to keep idle connections open to, and how many
+static struct port_map conn_pool;
+
+// idle connection timeouts in seconds, default and per port
+static uint32_t idle_timeout;
+static struct port_map idle_ports;
+
+static uint32_t tx_limit;
+static int tx_packing;
+
+static uint32_t conn_rate_up, conn_rate_down;
+static uint32_t device_rate_up, device_rate_down;
+
+/**
+ * Get the statistics of a device port, adding them on first use.
+ *
+ * @return The statistics, or NULL if they could not be allocated.
+ *   Callers then go without statistics for this event.
+ */
+static struct port_stats* get_port_stats(struct mux_device *dev, uint16_t port)
 {
-	struct mux_device *dev = NULL;
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *cdev, &device_list) {
-		if(cdev->id == device_id) {
-			dev = cdev;
-			break;
-		}
+	FOREACH(struct port_stats *ps, &dev->port_stats) {
+		if(ps->port == port)
+			return ps;
 	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
+	struct port_stats *ps = malloc(sizeof(struct port_stats));
+	if(!ps) {
+		usbmuxd_log(LL_ERROR, "Out of memory allocating statistics for device %d port %d", dev->id, port);
+		return NULL;
+	}
+	memset(ps, 0, sizeof(struct port_stats));
+	ps->port = port;
+	ps->syn_latency_min = UINT32_MAX;
+	collection_add(&dev->port_stats, ps);
+	return ps;
+}
 
-	return dev;
+static void free_port_stats(struct mux_device *dev)
+{
+	FOREACH(struct port_stats *ps, &dev->port_stats) {
+		free(ps);
+	} ENDFOREACH
+	collection_free(&dev->port_stats);
 }
 
-static struct mux_connection* get_mux_connection(int device_id, struct mux_client *client)
+/**
+ * Arrange for the connection pool of a device to be refilled from
+ * device_check_timeouts().
+ *
+ * @param dev The device.
+ * @param delay Milliseconds to wait before opening new connections.
+ */
+static void device_pool_schedule(struct mux_device *dev, uint32_t delay)
 {
-	struct mux_connection *conn = NULL;
+	uint64_t when;
+	if(!conn_pool.count)
+		return;
+	when = mstime64() + delay;
+	if(!dev->pool_refill_time || when < dev->pool_refill_time)
+		dev->pool_refill_time = when;
+}
+
+/**
+ * Start a lookup in the device registry. Every call must be paired
+ * with registry_leave() once the snapshot is not used anymore.
+ *
+ * @return The current device snapshot.
+ */
+static struct device_registry *registry_enter(void)
+{
+	__atomic_add_fetch(&registry_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&device_registry, __ATOMIC_SEQ_CST);
+}
+
+static void registry_leave(void)
+{
+	__atomic_sub_fetch(&registry_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void device_free(struct mux_device *dev);
+
+/**
+ * Free everything retired so far if there are no readers. A reader
+ * entering after this check can only see the current snapshot.
+ * Must be called with device_list_mutex held.
+ */
+static void registry_reclaim(void)
+{
+	if(__atomic_load_n(&registry_readers, __ATOMIC_SEQ_CST))
+		return;
+	FOREACH(void *p, &registry_retired) {
+		collection_remove(&registry_retired, p);
+		free(p);
+	} ENDFOREACH
+	FOREACH(struct mux_device *dev, &registry_retired_devs) {
+		collection_remove(&registry_retired_devs, dev);
+		device_free(dev);
+	} ENDFOREACH
+	__atomic_store_n(&registry_retired_count, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Free a snapshot as soon as no registry reader can reference it.
+ * Must be called with device_list_mutex held.
+ */
+static void registry_retire(void *p)
+{
+	collection_add(&registry_retired, p);
+	__atomic_add_fetch(&registry_retired_count, 1, __ATOMIC_SEQ_CST);
+	registry_reclaim();
+}
+
+/**
+ * Free a device that was taken out of device_list, together with
+ * everything it points to, as soon as no registry reader can reference
+ * it. Must be called with device_list_mutex held.
+ */
+static void registry_retire_device(struct mux_device *dev)
+{
+	collection_add(&registry_retired_devs, dev);
+	__atomic_add_fetch(&registry_retired_count, 1, __ATOMIC_SEQ_CST);
+	registry_reclaim();
+}
+
+/**
+ * Replace the registry snapshot with the current contents of
+ * device_list. Must be called with device_list_mutex held.
+ */
+static void registry_publish(void)
+{
+	struct device_registry *reg, *old;
+	reg = malloc(sizeof(struct device_registry) + sizeof(struct mux_device *) * collection_count(&device_list));
+	reg->count = 0;
 	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->id == device_id) {
-			FOREACH(struct mux_connection *lconn, &dev->connections) {
-				if(lconn->client == client) {
-					conn = lconn;
-					break;
-				}
-			} ENDFOREACH
+		reg->devs[reg->count++] = dev;
+	} ENDFOREACH
+	old = __atomic_exchange_n(&device_registry, reg, __ATOMIC_SEQ_CST);
+	if(old)
+		registry_retire(old);
+}
+
+/**
+ * Find a device in a registry snapshot. The device may only be used
+ * until the registry_leave() that ends the caller's lookup.
+ */
+static struct mux_device* get_mux_device_for_id(struct device_registry *reg, int device_id)
+{
+	int i;
+	for(i = 0; i < reg->count; i++) {
+		if(reg->devs[i]->id == device_id)
+			return reg->devs[i];
+	}
+	return NULL;
+}
+
+static struct mux_device* get_mux_device_for_usbdev(struct device_registry *reg, struct usb_device *usbdev)
+{
+	int i;
+	for(i = 0; i < reg->count; i++) {
+		if(reg->devs[i]->usbdev == usbdev)
+			return reg->devs[i];
+	}
+	return NULL;
+}
+
+static struct mux_connection* get_mux_connection(struct device_registry *reg, int device_id, struct mux_client *client)
+{
+	struct mux_connection *conn = NULL;
+	struct mux_device *dev = get_mux_device_for_id(reg, device_id);
+	if(!dev)
+		return NULL;
+	FOREACH(struct mux_connection *lconn, &dev->connections) {
+		if(lconn->client == client) {
+			conn = lconn;
 			break;
 		}
 	} ENDFOREACH
@@ -165,6 +498,15 @@ static struct mux_connection* get_mux_connection(int device_id, struct mux_clien
 	return conn;
 }
 
+static struct mux_connection* get_linger_connection(struct mux_client *client)
+{
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		if(conn->client == client)
+			return conn;
+	} ENDFOREACH
+	return NULL;
+}
+
 static int get_next_device_id(void)
 {
 	while(1) {
@@ -183,6 +525,222 @@ static int get_next_device_id(void)
 	}
 }
 
+static void device_tx_assign_seq(struct mux_device *dev, unsigned char *buf)
+{
+	if (dev->version >= 2) {
+		struct mux_header *mhdr = (struct mux_header *)buf;
+		if (ntohl(mhdr->protocol) == MUX_PROTO_SETUP) {
+			dev->tx_seq = 0;
+			dev->rx_seq = 0xFFFF;
+		}
+		mhdr->tx_seq = htons(dev->tx_seq);
+		mhdr->rx_seq = htons(dev->rx_seq);
+		dev->tx_seq++;
+	}
+}
+
+/**
+ * Submit the packets collected in a device's staging buffer as a
+ * single bulk transfer.
+ *
+ * @return 0 on success (or if nothing was staged), < 0 on error.
+ */
+static int device_tx_flush_staged(struct mux_device *dev)
+{
+	int res;
+	if(!dev->pack_len)
+		return 0;
+	usbmuxd_log(LL_SPEW, "Sending %d packed packets (%d bytes) to device %d", dev->pack_count, dev->pack_len, dev->id);
+	dev->packed_packets += dev->pack_count;
+	dev->packed_transfers++;
+	res = usb_send(dev->usbdev, dev->pack_buf, dev->pack_len);
+	if(res < 0) {
+		usbmuxd_log(LL_ERROR, "usb_send failed while sending packed packets (len %d) to device %d: %d", dev->pack_len, dev->id, res);
+		dev->tx_inflight -= dev->pack_len;
+		free(dev->pack_buf);
+	}
+	dev->pack_buf = NULL;
+	dev->pack_len = 0;
+	dev->pack_count = 0;
+	return res;
+}
+
+/**
+ * Hand a packet to USB. For protocol version 2 the mux sequence
+ * numbers are filled in here rather than when the packet is built,
+ * so they stay in order when the TX queue reorders packets. With
+ * packing enabled, small packets are collected in the staging buffer
+ * instead (see device_tx_flush).
+ */
+static int device_tx_submit(struct mux_device *dev, unsigned char *buf, uint32_t length)
+{
+	int res;
+	int small = (dev->pack_state == PACK_ON && length < PACK_SMALL);
+	if(dev->pack_len && (!small || dev->pack_len + length > USB_MTU)) {
+		// staged packets go first to keep the order
+		device_tx_flush_staged(dev);
+	}
+	if(small && !dev->pack_buf && !(dev->pack_buf = malloc(USB_MTU))) {
+		// without a staging buffer the packet goes out on its own
+		small = 0;
+	}
+	device_tx_assign_seq(dev, buf);
+	dev->tx_inflight += length;
+	if(small) {
+		memcpy(dev->pack_buf + dev->pack_len, buf, length);
+		dev->pack_len += length;
+		dev->pack_count++;
+		free(buf);
+		return 0;
+	}
+	if((res = usb_send(dev->usbdev, buf, length)) < 0) {
+		usbmuxd_log(LL_ERROR, "usb_send failed while sending packet (len %d) to device %d: %d", length, dev->id, res);
+		dev->tx_inflight -= length;
+		free(buf);
+		return res;
+	}
+	return 0;
+}
+
+/**
+ * Submit queued packets, highest priority first, as long as the
+ * device's in-flight limit allows.
+ *
+ * The queue is only kicked again when a transfer completes, so this
+ * never stops while nothing but staged packets is in flight: those
+ * are submitted first, and if that fails too the queue is drained
+ * further instead of waiting for a completion that will not come.
+ */
+static void device_tx_kick(struct mux_device *dev)
+{
+	int prio;
+	for(prio = 0; prio < TX_PRIO_COUNT; prio++) {
+		struct tx_packet *pkt;
+		while((pkt = dev->txq_head[prio])) {
+			if(dev->tx_inflight && dev->tx_inflight + pkt->length > dev->tx_limit) {
+				if(dev->tx_inflight > dev->pack_len || device_tx_flush_staged(dev) >= 0)
+					return;
+				continue;
+			}
+			dev->txq_head[prio] = pkt->next;
+			if(!pkt->next)
+				dev->txq_tail[prio] = NULL;
+			dev->tx_queued -= pkt->length;
+			if(pkt->conn)
+				pkt->conn->tx_queued -= pkt->length;
+			device_tx_submit(dev, pkt->buf, pkt->length);
+			free(pkt);
+		}
+	}
+}
+
+/**
+ * Send a packet to a device, or queue it if the device already has
+ * tx_limit bytes in flight. Takes ownership of buf.
+ *
+ * @param dev The device to send to.
+ * @param conn The connection the packet belongs to, or NULL.
+ * @param prio Queue class, 0 is sent first.
+ * @param buf The packet, allocated with malloc().
+ * @param length Length of the packet.
+ * @return 0 on success, < 0 if the packet could not be submitted.
+ */
+static int device_tx_send(struct mux_device *dev, struct mux_connection *conn, int prio, unsigned char *buf, uint32_t length)
+{
+	if(!dev->tx_queued && (!dev->tx_inflight || dev->tx_inflight + length <= dev->tx_limit))
+		return device_tx_submit(dev, buf, length);
+
+	struct tx_packet *pkt = malloc(sizeof(struct tx_packet));
+	if(!pkt) {
+		usbmuxd_log(LL_ERROR, "Out of memory while queueing packet (len %d) for device %d", length, dev->id);
+		free(buf);
+		return -1;
+	}
+	pkt->next = NULL;
+	pkt->conn = conn;
+	pkt->buf = buf;
+	pkt->length = length;
+	if(dev->txq_tail[prio])
+		dev->txq_tail[prio]->next = pkt;
+	else
+		dev->txq_head[prio] = pkt;
+	dev->txq_tail[prio] = pkt;
+	dev->tx_queued += length;
+	if(conn)
+		conn->tx_queued += length;
+	return 0;
+}
+
+/**
+ * Drop a connection's references from the TX queues before it is
+ * freed. Its packets are still sent.
+ */
+static void device_tx_forget(struct mux_device *dev, struct mux_connection *conn)
+{
+	int prio;
+	if(!conn->tx_queued)
+		return;
+	for(prio = 0; prio < TX_PRIO_COUNT; prio++) {
+		struct tx_packet *pkt;
+		for(pkt = dev->txq_head[prio]; pkt; pkt = pkt->next) {
+			if(pkt->conn == conn)
+				pkt->conn = NULL;
+		}
+	}
+	conn->tx_queued = 0;
+}
+
+static void device_tx_flush_queue(struct mux_device *dev)
+{
+	int prio;
+	for(prio = 0; prio < TX_PRIO_COUNT; prio++) {
+		while(dev->txq_head[prio]) {
+			struct tx_packet *pkt = dev->txq_head[prio];
+			dev->txq_head[prio] = pkt->next;
+			free(pkt->buf);
+			free(pkt);
+		}
+		dev->txq_tail[prio] = NULL;
+	}
+	dev->tx_queued = 0;
+}
+
+/**
+ * Called by the USB layer when a TX transfer finished. Adapts the
+ * device's in-flight limit to the completion latency, similar to BQL:
+ * the limit shrinks while transfers take longer than TX_TARGET_LATENCY
+ * and grows while packets are waiting and USB keeps up.
+ *
+ * @param usbdev The USB device.
+ * @param length Length of the transfer.
+ * @param latency Time from submission to completion in us.
+ */
+void device_tx_complete(struct usb_device *usbdev, uint32_t length, uint64_t latency)
+{
+	struct device_registry *reg = registry_enter();
+	struct mux_device *dev = get_mux_device_for_usbdev(reg, usbdev);
+	if(!dev) {
+		registry_leave();
+		return;
+	}
+
+	dev->tx_inflight = (dev->tx_inflight > length) ? dev->tx_inflight - length : 0;
+	dev->tx_latency = dev->tx_latency ? (dev->tx_latency * 7 + latency) / 8 : latency;
+	if(!tx_limit) {
+		if(dev->tx_latency > TX_TARGET_LATENCY) {
+			dev->tx_limit -= dev->tx_limit / 8;
+			if(dev->tx_limit < TX_LIMIT_MIN)
+				dev->tx_limit = TX_LIMIT_MIN;
+		} else if(dev->tx_queued && dev->tx_latency < TX_TARGET_LATENCY / 2) {
+			dev->tx_limit += USB_MTU;
+			if(dev->tx_limit > TX_LIMIT_MAX)
+				dev->tx_limit = TX_LIMIT_MAX;
+		}
+	}
+	device_tx_kick(dev);
+	registry_leave();
+}
+
 static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *header, const void *data, int length)
 {
 	unsigned char *buffer;
@@ -215,31 +773,45 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 	}
 
 	buffer = malloc(total);
+	memset(buffer, 0, mux_header_size);
 	struct mux_header *mhdr = (struct mux_header *)buffer;
 	mhdr->protocol = htonl(proto);
 	mhdr->length = htonl(total);
 	if (dev->version >= 2) {
 		mhdr->magic = htonl(0xfeedface);
-		if (proto == MUX_PROTO_SETUP) {
-			dev->tx_seq = 0;
-			dev->rx_seq = 0xFFFF;
-		}
-		mhdr->tx_seq = htons(dev->tx_seq);
-		mhdr->rx_seq = htons(dev->rx_seq);
-		dev->tx_seq++;
 	}
 	memcpy(buffer + mux_header_size, header, hdrlen);
 	if(data && length)
 		memcpy(buffer + mux_header_size + hdrlen, data, length);
 
-	if((res = usb_send(dev->usbdev, buffer, total)) < 0) {
-		usbmuxd_log(LL_ERROR, "usb_send failed while sending packet (len %d) to device %d: %d", total, dev->id, res);
-		free(buffer);
+	if((res = device_tx_send(dev, NULL, 0, buffer, total)) < 0)
 		return res;
-	}
 	return total;
 }
 
+/**
+ * Prepare the header template used by send_tcp(). Everything but
+ * the length, the mux sequence numbers and the TCP seq, ack, flags
+ * and window fields is the same for every packet of a connection.
+ *
+ * @param conn The connection to prepare the header for.
+ */
+static void connection_init_header(struct mux_connection *conn)
+{
+	int mux_header_size = ((conn->dev->version < 2) ? 8 : sizeof(struct mux_header));
+	struct mux_header *mhdr = (struct mux_header *)conn->tx_hdr;
+	struct tcphdr *th = (struct tcphdr *)(conn->tx_hdr + mux_header_size);
+
+	memset(conn->tx_hdr, 0, sizeof(conn->tx_hdr));
+	mhdr->protocol = htonl(MUX_PROTO_TCP);
+	if (conn->dev->version >= 2)
+		mhdr->magic = htonl(0xfeedface);
+	th->th_sport = htons(conn->sport);
+	th->th_dport = htons(conn->dport);
+	th->th_off = sizeof(struct tcphdr) / 4;
+	conn->tx_hdr_len = mux_header_size + sizeof(struct tcphdr);
+}
+
 static uint16_t find_sport(struct mux_device *dev)
 {
 	if(collection_count(&dev->connections) >= 65535)
@@ -247,6 +819,11 @@ static uint16_t find_sport(struct mux_device *dev)
 
 	while(1) {
 		int ok = 1;
+		if((dev->next_sport & ~1) == PACK_PROBE_SPORT) {
+			// reserved for device_pack_probe()
+			dev->next_sport = PACK_PROBE_SPORT + 2;
+			continue;
+		}
 		FOREACH(struct mux_connection *conn, &dev->connections) {
 			if(dev->next_sport == conn->sport) {
 				dev->next_sport++;
@@ -275,37 +852,293 @@ static int send_anon_rst(struct mux_device *dev, uint16_t sport, uint16_t dport,
 	return res;
 }
 
+/**
+ * Find out whether a device handles several mux packets in one USB
+ * transfer: two SYNs to a port that is normally closed are sent
+ * packed, and packing is only enabled if both of them are answered.
+ *
+ * @param dev The device to probe.
+ */
+static void device_pack_probe(struct mux_device *dev)
+{
+	int i;
+	usbmuxd_log(LL_INFO, "Checking whether device %d accepts packed transfers", dev->id);
+	dev->pack_state = PACK_ON;
+	for(i = 0; i < 2; i++) {
+		struct tcphdr th;
+		memset(&th, 0, sizeof(th));
+		th.th_sport = htons(PACK_PROBE_SPORT + i);
+		th.th_dport = htons(PACK_PROBE_DPORT);
+		th.th_flags = TH_SYN;
+		th.th_off = sizeof(th) / 4;
+		th.th_win = htons(131072 >> 8);
+		send_packet(dev, MUX_PROTO_TCP, &th, NULL, 0);
+	}
+	device_tx_flush_staged(dev);
+	dev->pack_state = PACK_PROBING;
+	dev->pack_probe_seen = 0;
+	dev->pack_probe_deadline = mstime64() + PACK_PROBE_TIMEOUT;
+}
+
 static int send_tcp(struct mux_connection *conn, uint8_t flags, const unsigned char *data, int length)
 {
-	struct tcphdr th;
-	memset(&th, 0, sizeof(th));
-	th.th_sport = htons(conn->sport);
-	th.th_dport = htons(conn->dport);
-	th.th_seq = htonl(conn->tx_seq);
-	th.th_ack = htonl(conn->tx_ack);
-	th.th_flags = flags;
-	th.th_off = sizeof(th) / 4;
-	th.th_win = htons(conn->tx_win >> 8);
+	struct mux_device *dev = conn->dev;
+	int total = conn->tx_hdr_len + length;
+	int res;
 
 	usbmuxd_log(LL_DEBUG, "[OUT] dev=%d sport=%d dport=%d seq=%d ack=%d flags=0x%x window=%d[%d] len=%d",
-		conn->dev->id, conn->sport, conn->dport, conn->tx_seq, conn->tx_ack, flags, conn->tx_win, conn->tx_win >> 8, length);
+		dev->id, conn->sport, conn->dport, conn->tx_seq, conn->tx_ack, flags, conn->tx_win, conn->tx_win >> 8, length);
 
-	int res = send_packet(conn->dev, MUX_PROTO_TCP, &th, data, length);
-	if(res >= 0) {
-		conn->tx_acked = conn->tx_ack;
-		conn->last_ack_time = mstime64();
-		conn->flags &= ~CONN_ACK_PENDING;
+	if(total > USB_MTU) {
+		usbmuxd_log(LL_ERROR, "Tried to send packet larger than USB MTU (hdr %d data %d total %d) to device %d", conn->tx_hdr_len, length, total, dev->id);
+		return -1;
 	}
-	return res;
+
+	// the packet is built from the connection's header template right
+	// in the TX buffer; only the per-packet fields are filled in
+	unsigned char *buffer = malloc(total);
+	memcpy(buffer, conn->tx_hdr, conn->tx_hdr_len);
+	struct mux_header *mhdr = (struct mux_header *)buffer;
+	mhdr->length = htonl(total);
+	struct tcphdr *th = (struct tcphdr *)(buffer + conn->tx_hdr_len - sizeof(struct tcphdr));
+	th->th_seq = htonl(conn->tx_seq);
+	th->th_ack = htonl(conn->tx_ack);
+	th->th_flags = flags;
+	th->th_win = htons(conn->tx_win >> 8);
+	if(data && length)
+		memcpy(buffer + conn->tx_hdr_len, data, length);
+
+	// bare ACKs may overtake bulk data, unless data of the same
+	// connection is still queued; device_tx_send() owns the buffer
+	// and the submission error handling from here on
+	int prio = (length == 0 && !conn->tx_queued) ? 0 : conn->priority + 1;
+	if((res = device_tx_send(dev, conn, prio, buffer, total)) < 0)
+		return res;
+	conn->tx_acked = conn->tx_ack;
+	conn->last_ack_time = mstime64();
+	conn->flags &= ~CONN_ACK_PENDING;
+	return total;
+}
+
+/**
+ * Take a connection object from the device's slabs, adding a new slab
+ * if all of them are in use. Slabs stay with the device until it is
+ * removed; up to CONN_FREE_BUFS released objects keep their buffers,
+ * so a new connection usually needs no allocation at all.
+ *
+ * @param dev The device the connection is for.
+ * @return The connection, or NULL if out of memory.
+ */
+static struct mux_connection *conn_alloc(struct mux_device *dev)
+{
+	struct mux_connection *conn;
+	if(!dev->conn_free) {
+		struct conn_slab *slab;
+		int i;
+		if(posix_memalign((void**)&slab, CACHELINE_SIZE, sizeof(struct conn_slab)))
+			return NULL;
+		memset(slab, 0, sizeof(struct conn_slab));
+		for(i = CONN_SLAB_OBJS - 1; i >= 0; i--) {
+			slab->conns[i].next_free = dev->conn_free;
+			dev->conn_free = &slab->conns[i];
+		}
+		slab->next = dev->conn_slabs;
+		dev->conn_slabs = slab;
+		dev->slab_mem += sizeof(struct conn_slab);
+	}
+	conn = dev->conn_free;
+	dev->conn_free = conn->next_free;
+	if(conn->ib_buf || conn->ob_buf)
+		dev->conn_free_bufs--;
+	return conn;
+}
+
+/**
+ * Resize a connection buffer and keep the device's buffer memory
+ * count up to date.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int conn_buf_resize(struct mux_device *dev, unsigned char **buf, uint32_t *capacity, uint32_t size)
+{
+	unsigned char *nbuf = realloc(*buf, size);
+	if(!nbuf)
+		return -1;
+	dev->buf_mem -= *capacity;
+	dev->buf_mem += size;
+	*buf = nbuf;
+	*capacity = size;
+	return 0;
+}
+
+/**
+ * Make sure a connection buffer can hold needed bytes, doubling its
+ * size as often as necessary.
+ *
+ * @return 0 on success, -1 if needed is above max or out of memory.
+ */
+static int conn_buf_reserve(struct mux_device *dev, unsigned char **buf, uint32_t *capacity, uint32_t needed, uint32_t max)
+{
+	uint32_t size = *capacity ? *capacity : CONN_BUF_MIN;
+	if(needed <= *capacity)
+		return 0;
+	if(needed > max)
+		return -1;
+	while(size < needed)
+		size *= 2;
+	if(size > max)
+		size = max;
+	return conn_buf_resize(dev, buf, capacity, size);
+}
+
+/**
+ * Give back buffer memory of a connection whose buffers are empty.
+ */
+static void connection_shrink_buffers(struct mux_connection *conn)
+{
+	if(!conn->ib_size && conn->ib_capacity > CONN_BUF_MIN)
+		conn_buf_resize(conn->dev, &conn->ib_buf, &conn->ib_capacity, CONN_BUF_MIN);
+	if(!conn->ob_size && conn->ob_capacity > CONN_BUF_MIN)
+		conn_buf_resize(conn->dev, &conn->ob_buf, &conn->ob_capacity, CONN_BUF_MIN);
+}
+
+static void conn_release(struct mux_device *dev, struct mux_connection *conn)
+{
+	conn->ib_size = 0;
+	conn->ob_size = 0;
+	if(dev->conn_free_bufs < CONN_FREE_BUFS) {
+		// free objects only keep small buffers
+		connection_shrink_buffers(conn);
+	} else {
+		// a burst of connections must not pin its buffers
+		dev->buf_mem -= conn->ib_capacity + conn->ob_capacity;
+		free(conn->ib_buf);
+		free(conn->ob_buf);
+		conn->ib_buf = NULL;
+		conn->ob_buf = NULL;
+		conn->ib_capacity = 0;
+		conn->ob_capacity = 0;
+	}
+	if(conn->ib_buf || conn->ob_buf)
+		dev->conn_free_bufs++;
+	conn->next_free = dev->conn_free;
+	dev->conn_free = conn;
+}
+
+static void conn_slabs_free(struct mux_device *dev)
+{
+	int i;
+	while(dev->conn_slabs) {
+		struct conn_slab *slab = dev->conn_slabs;
+		dev->conn_slabs = slab->next;
+		for(i = 0; i < CONN_SLAB_OBJS; i++) {
+			free(slab->conns[i].ib_buf);
+			free(slab->conns[i].ob_buf);
+		}
+		free(slab);
+	}
+	dev->conn_free = NULL;
+	dev->conn_free_bufs = 0;
+	dev->slab_mem = 0;
+}
+
+/**
+ * Detach a dead connection from its device and keep it around until
+ * the data left in its in-buffer was written to the client. The
+ * client is polled for POLLOUT and the rest happens from the main
+ * loop (see connection_linger_process), so a dying connection never
+ * blocks the daemon.
+ *
+ * @param conn The connection to linger.
+ */
+static void connection_linger(struct mux_connection *conn)
+{
+	struct mux_connection *lconn;
+	usbmuxd_log(LL_DEBUG, "%s: flushing buffer to client (%u bytes)", __func__, conn->ib_size);
+	device_tx_forget(conn->dev, conn);
+	collection_remove(&conn->dev->connections, conn);
+	// the device and its slabs may go away first, so move out of them
+	if(posix_memalign((void**)&lconn, CACHELINE_SIZE, sizeof(struct mux_connection))) {
+		usbmuxd_log(LL_ERROR, "%s: out of memory, dropping %u bytes for the client", __func__, conn->ib_size);
+		client_close(conn->client);
+		conn_release(conn->dev, conn);
+		return;
+	}
+	*lconn = *conn;
+	conn->dev->buf_mem -= conn->ib_capacity;
+	conn->ib_buf = NULL;
+	conn->ib_capacity = 0;
+	conn->ib_size = 0;
+	conn_release(conn->dev, conn);
+	conn = lconn;
+	conn->dev = NULL;
+	conn->ob_buf = NULL;
+	conn->ob_size = 0;
+	conn->state = CONN_LINGER;
+	conn->linger_deadline = mstime64() + LINGER_TIMEOUT;
+	conn->events = POLLOUT;
+	collection_add(&linger_list, conn);
+	client_set_events(conn->client, conn->events);
+}
+
+static void connection_linger_finish(struct mux_connection *conn)
+{
+	collection_remove(&linger_list, conn);
+	client_close(conn->client);
+	free(conn->ib_buf);
+	free(conn);
+}
+
+static void connection_linger_process(struct mux_connection *conn)
+{
+	int size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+	if(size < 0) {
+		usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after error.", __func__);
+		connection_linger_finish(conn);
+		return;
+	}
+	if(size == 0)
+		return;
+	if(size == (int)conn->ib_size) {
+		connection_linger_finish(conn);
+		return;
+	}
+	conn->ib_size -= size;
+	memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
+	conn->linger_deadline = mstime64() + LINGER_TIMEOUT;
+}
+
+/**
+ * Hold off refilling the pool for a port the device did not accept a
+ * pooled connection on, backing off further on every failure.
+ */
+static void device_pool_backoff(struct mux_device *dev, uint16_t port)
+{
+	struct port_stats *ps = get_port_stats(dev, port);
+	if(!ps) {
+		device_pool_schedule(dev, POOL_RETRY);
+		return;
+	}
+	ps->pool_backoff = ps->pool_backoff ? ps->pool_backoff * 2 : POOL_RETRY;
+	if(ps->pool_backoff > POOL_RETRY_MAX)
+		ps->pool_backoff = POOL_RETRY_MAX;
+	ps->pool_retry_at = mstime64() + ps->pool_backoff;
+	usbmuxd_log(LL_DEBUG, "Pooled connection to device %d port %d failed, retrying in %u ms", dev->id, port, ps->pool_backoff);
+	device_pool_schedule(dev, ps->pool_backoff);
 }
 
 static void connection_teardown(struct mux_connection *conn)
 {
 	int res;
-	int size;
 	if(conn->state == CONN_DEAD)
 		return;
 	usbmuxd_log(LL_DEBUG, "connection_teardown dev %d sport %d dport %d", conn->dev->id, conn->sport, conn->dport);
+	if(conn->pooled && conn->dev->state == MUXDEV_ACTIVE) {
+		if(conn->state == CONN_REFUSED || conn->state == CONN_CONNECTING)
+			device_pool_backoff(conn->dev, conn->dport);
+		else
+			device_pool_schedule(conn->dev, POOL_RETRY);
+	}
 	if(conn->dev->state != MUXDEV_DEAD && conn->state != CONN_DYING && conn->state != CONN_REFUSED) {
 		res = send_tcp(conn, TH_RST, NULL, 0);
 		if(res < 0)
@@ -316,58 +1149,89 @@ static void connection_teardown(struct mux_connection *conn)
 			client_notify_connect(conn->client, RESULT_CONNREFUSED);
 		} else {
 			conn->state = CONN_DEAD;
-			if((conn->events & POLLOUT) && conn->ib_size > 0){
-				usbmuxd_log(LL_DEBUG, "%s: flushing buffer to client (%u bytes)", __func__, conn->ib_size);
-				uint64_t tm_last = mstime64();
-				while(1){
-					size = client_write(conn->client, conn->ib_buf, conn->ib_size);
-					if(size < 0) {
-						usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after error.", __func__);
-						break;
-					} else if (size == 0) {
-						uint64_t tm_now = mstime64();
-						if (tm_now - tm_last > 1000) {
-							usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after unsuccessfully attempting for %dms.", __func__, (int)(tm_now - tm_last));
-							break;
-						}
-						usleep(10000);
-						continue;
-					}
-					if(size == (int)conn->ib_size) {
-						conn->ib_size = 0;
-						break;
-					} else {
-						conn->ib_size -= size;
-						memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-					}
-					tm_last = mstime64();
-				}
+			if(conn->ib_size > 0) {
+				connection_linger(conn);
+				return;
+			}
+			if(conn->dev->state == MUXDEV_DEAD) {
+				// device_remove closes all of them at once
+				client_close_deferred(conn->client);
+			} else {
+				client_close(conn->client);
 			}
-			client_close(conn->client);
 		}
 	}
-	free(conn->ib_buf);
-	free(conn->ob_buf);
+	device_tx_forget(conn->dev, conn);
 	collection_remove(&conn->dev->connections, conn);
-	free(conn);
+	conn_release(conn->dev, conn);
 }
 
-int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
+/**
+ * Get the earliest time at which device_check_timeouts() has to look
+ * at a connection again.
+ *
+ * @param conn The connection to check.
+ * @return The time in ms, or (uint64_t)-1 if nothing is pending.
+ */
+static uint64_t connection_next_check(struct mux_connection *conn)
 {
-	struct mux_device *dev = get_mux_device_for_id(device_id);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
-		return -RESULT_BADDEV;
-	}
+	uint64_t due = (uint64_t)-1LL;
+	if((conn->state == CONN_CONNECTING) && conn->connect_deadline && conn->connect_deadline < due)
+		due = conn->connect_deadline;
+	if((conn->state == CONN_CONNECTED) && conn->idle_timeout && !conn->pooled && (conn->last_activity + conn->idle_timeout) < due)
+		due = conn->last_activity + conn->idle_timeout;
+	if(((!conn->ib_size && conn->ib_capacity > CONN_BUF_MIN) || (!conn->ob_size && conn->ob_capacity > CONN_BUF_MIN)) && (conn->last_activity + CONN_BUF_IDLE) < due)
+		due = conn->last_activity + CONN_BUF_IDLE;
+	// round us deadlines up so they have passed once we look
+	if(conn->coalesce_deadline && (conn->coalesce_deadline + 999) / 1000 < due)
+		due = (conn->coalesce_deadline + 999) / 1000;
+	if(conn->throttle_deadline && (conn->throttle_deadline + 999) / 1000 < due)
+		due = (conn->throttle_deadline + 999) / 1000;
+	if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING) && (conn->last_ack_time + ACK_TIMEOUT + 1) < due)
+		due = conn->last_ack_time + ACK_TIMEOUT + 1;
+	return due;
+}
+
+/**
+ * Pull the device's next check in if one of the connection's
+ * deadlines moved before it.
+ *
+ * @param conn The connection whose deadlines might have moved.
+ */
+static void connection_arm_check(struct mux_connection *conn)
+{
+	uint64_t due = connection_next_check(conn);
+	if(due < conn->dev->next_check)
+		conn->dev->next_check = due;
+}
 
+/**
+ * Allocate a new connection to a device port and send the SYN.
+ *
+ * @param dev The device to connect to.
+ * @param dport The port on the device.
+ * @param client The client the connection belongs to, or NULL for
+ *   a pooled connection.
+ * @return 0 on success, a negative RESULT_* value otherwise.
+ */
+static int connection_create(struct mux_device *dev, uint16_t dport, struct mux_client *client)
+{
 	uint16_t sport = find_sport(dev);
 	if(!sport) {
-		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", device_id);
+		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", dev->id);
 		return -RESULT_BADDEV;
 	}
 
-	struct mux_connection *conn;
-	conn = malloc(sizeof(struct mux_connection));
+	struct mux_connection *conn = conn_alloc(dev);
+	if(!conn) {
+		usbmuxd_log(LL_ERROR, "Out of memory allocating a connection for device %d", dev->id);
+		return -RESULT_BADDEV;
+	}
+	// buffers are kept from the object's previous use
+	unsigned char *ib_buf = conn->ib_buf;
+	unsigned char *ob_buf = conn->ob_buf;
+	uint32_t ib_capacity = conn->ib_capacity;
+	uint32_t ob_capacity = conn->ob_capacity;
 	memset(conn, 0, sizeof(struct mux_connection));
 
 	conn->dev = dev;
@@ -383,23 +1247,50 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 	conn->flags = 0;
 	conn->max_payload = USB_MTU - sizeof(struct mux_header) - sizeof(struct tcphdr);
 
-	conn->ob_buf = malloc(CONN_OUTBUF_SIZE);
-	conn->ob_capacity = CONN_OUTBUF_SIZE;
-	conn->ib_buf = malloc(CONN_INBUF_SIZE);
-	conn->ib_capacity = CONN_INBUF_SIZE;
+	int delay = port_map_get(&coalesce_ports, dport, coalesce_delay);
+	conn->coalesce_delay = (delay > 0) ? delay : 0;
+	int weight = port_map_get(&tx_weights, dport, 1);
+	drr_init(&conn->drr, weight, TX_QUANTUM);
+	conn->priority = port_map_get(&port_priorities, dport, CONN_PRIO_DEFAULT);
+	if(conn->priority < 0)
+		conn->priority = 0;
+	else if(conn->priority >= CONN_PRIO_COUNT)
+		conn->priority = CONN_PRIO_COUNT - 1;
+	rate_init(&conn->rate_up, conn_rate_up);
+	rate_init(&conn->rate_down, conn_rate_down);
+	conn->throttle_deadline = 0;
+
+	// start small, most connections never move more than a few KB
+	conn->ob_buf = ob_buf;
+	conn->ob_capacity = ob_capacity;
+	conn->ob_size = 0;
+	conn->ib_buf = ib_buf;
+	conn->ib_capacity = ib_capacity;
 	conn->ib_size = 0;
+	if(conn_buf_reserve(dev, &conn->ob_buf, &conn->ob_capacity, CONN_BUF_MIN, CONN_OUTBUF_SIZE) < 0 ||
+			conn_buf_reserve(dev, &conn->ib_buf, &conn->ib_capacity, CONN_BUF_MIN, CONN_INBUF_SIZE) < 0) {
+		usbmuxd_log(LL_ERROR, "Out of memory allocating buffers for device %d connection %d->%d", dev->id, sport, dport);
+		conn_release(dev, conn);
+		return -RESULT_BADDEV;
+	}
+	connection_init_header(conn);
+	conn->connect_start = ustime64();
+	conn->connect_deadline = connect_timeout ? mstime64() + connect_timeout : 0;
+
+	conn->pooled = (client == NULL);
+	conn->idle_timeout = port_map_get(&idle_ports, dport, idle_timeout) * 1000;
+	conn->last_activity = mstime64();
 
 	int res;
 
 	res = send_tcp(conn, TH_SYN, NULL, 0);
 	if(res < 0) {
 		usbmuxd_log(LL_ERROR, "Error sending TCP SYN to device %d (%d->%d)", dev->id, sport, dport);
-		free(conn->ib_buf);
-		free(conn->ob_buf);
-		free(conn);
+		conn_release(dev, conn);
 		return -RESULT_CONNREFUSED; //bleh
 	}
 	collection_add(&dev->connections, conn);
+	connection_arm_check(conn);
 	return 0;
 }
 
@@ -419,28 +1310,191 @@ static void update_connection(struct mux_connection *conn)
 	else
 		conn->sendable = 0;
 
-	if(conn->sendable > conn->ob_capacity)
-		conn->sendable = conn->ob_capacity;
+	if(tx_max_inflight) {
+		if(sent >= tx_max_inflight)
+			conn->sendable = 0;
+		else if(conn->sendable > tx_max_inflight - sent)
+			conn->sendable = tx_max_inflight - sent;
+	}
+
+	if(conn->sendable > CONN_OUTBUF_SIZE)
+		conn->sendable = CONN_OUTBUF_SIZE;
 	if(conn->sendable > conn->max_payload)
 		conn->sendable = conn->max_payload;
 
-	if(conn->sendable > 0)
+	// Rate limits: hold back client data when the connection's or the
+	// device's bucket is empty, and stop draining the in-buffer (which
+	// delays the window update to the device) in the other direction
+	uint64_t now = ustime64();
+	conn->throttle_deadline = 0;
+	if(conn->sendable > conn->ob_size) {
+		struct token_bucket *tb = &conn->rate_up;
+		int64_t avail = rate_available(&conn->rate_up, now);
+		int64_t dev_avail = rate_available(&conn->dev->rate_up, now);
+		if(dev_avail < avail) {
+			tb = &conn->dev->rate_up;
+			avail = dev_avail;
+		}
+		if(avail <= 0) {
+			if(!(conn->flags & CONN_THROTTLED_UP))
+				tb->throttled++;
+			conn->flags |= CONN_THROTTLED_UP;
+			conn->sendable = conn->ob_size;
+			conn->throttle_deadline = now + rate_wait(tb);
+		} else {
+			conn->flags &= ~CONN_THROTTLED_UP;
+			if((uint64_t)avail < conn->sendable - conn->ob_size)
+				conn->sendable = conn->ob_size + avail;
+		}
+	} else {
+		conn->flags &= ~CONN_THROTTLED_UP;
+	}
+
+	if(conn->sendable > conn->ob_size)
 		conn->events |= POLLIN;
 	else
 		conn->events &= ~POLLIN;
 
-	if(conn->ib_size)
-		conn->events |= POLLOUT;
-	else
-		conn->events &= ~POLLOUT;
+	conn->events &= ~POLLOUT;
+	if(conn->ib_size) {
+		struct token_bucket *tb = &conn->rate_down;
+		if(rate_available(&conn->dev->rate_down, now) < rate_available(tb, now))
+			tb = &conn->dev->rate_down;
+		if(rate_available(tb, now) > 0) {
+			conn->flags &= ~CONN_THROTTLED_DOWN;
+			conn->events |= POLLOUT;
+		} else {
+			if(!(conn->flags & CONN_THROTTLED_DOWN))
+				tb->throttled++;
+			conn->flags |= CONN_THROTTLED_DOWN;
+			uint64_t deadline = now + rate_wait(tb);
+			if(!conn->throttle_deadline || deadline < conn->throttle_deadline)
+				conn->throttle_deadline = deadline;
+		}
+	} else {
+		conn->flags &= ~CONN_THROTTLED_DOWN;
+	}
 
 	if(conn->tx_acked != conn->tx_ack)
 		conn->flags |= CONN_ACK_PENDING;
 	else
 		conn->flags &= ~CONN_ACK_PENDING;
+	connection_arm_check(conn);
 
 	usbmuxd_log(LL_SPEW, "update_connection: sendable %d, events %d, flags %d", conn->sendable, conn->events, conn->flags);
-	client_set_events(conn->client, conn->events);
+	if(conn->client)
+		client_set_events(conn->client, conn->events);
+}
+
+/**
+ * Hand a pooled connection to a port over to a client.
+ *
+ * @return 1 if a pooled connection was found, 0 otherwise, or a
+ *   negative RESULT_* value if the client could not be notified.
+ */
+static int device_pool_take(struct mux_device *dev, uint16_t dport, struct mux_client *client)
+{
+	struct mux_connection *conn = NULL;
+	FOREACH(struct mux_connection *lconn, &dev->connections) {
+		if(lconn->pooled && lconn->dport == dport) {
+			// prefer connections the device has already accepted
+			if(!conn || (lconn->state == CONN_CONNECTED && conn->state != CONN_CONNECTED))
+				conn = lconn;
+		}
+	} ENDFOREACH
+	if(!conn)
+		return 0;
+
+	usbmuxd_log(LL_DEBUG, "Using pooled connection %d->%d for device %d", conn->sport, dport, dev->id);
+	conn->pooled = 0;
+	conn->client = client;
+	conn->last_activity = mstime64();
+	struct port_stats *ps = get_port_stats(dev, dport);
+	if(ps)
+		ps->pool_hits++;
+	device_pool_schedule(dev, 0);
+	if(conn->state == CONN_CONNECTED) {
+		if(client_notify_connect(client, RESULT_OK) < 0) {
+			conn->client = NULL;
+			connection_teardown(conn);
+			return -RESULT_CONNREFUSED;
+		}
+		update_connection(conn);
+	}
+	// otherwise the client is notified once the device accepts it
+	return 1;
+}
+
+static int device_do_start_connect(struct mux_device *dev, uint16_t dport, struct mux_client *client)
+{
+	if(refused_cache_ttl) {
+		struct port_stats *ps = get_port_stats(dev, dport);
+		if(ps && ps->refused_until > mstime64()) {
+			ps->refused_hits++;
+			usbmuxd_log(LL_INFO, "Port %d of device %d refused recently, not trying again", dport, dev->id);
+			return -RESULT_CONNREFUSED;
+		}
+	}
+
+	if(conn_pool.count) {
+		int res = device_pool_take(dev, dport, client);
+		if(res < 0)
+			return res;
+		if(res)
+			return 0;
+	}
+
+	return connection_create(dev, dport, client);
+}
+
+int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
+{
+	int res;
+	struct device_registry *reg = registry_enter();
+	struct mux_device *dev = get_mux_device_for_id(reg, device_id);
+	if(!dev) {
+		registry_leave();
+		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
+		return -RESULT_BADDEV;
+	}
+	res = device_do_start_connect(dev, dport, client);
+	registry_leave();
+	return res;
+}
+
+/**
+ * Open connections for the ports in the connection pool until each
+ * one has the configured number of idle connections.
+ *
+ * @param dev The device to fill the pool for.
+ */
+static void device_pool_refill(struct mux_device *dev)
+{
+	int i;
+	uint64_t now = mstime64();
+	for(i = 0; i < conn_pool.count; i++) {
+		uint16_t port = conn_pool.entries[i].port;
+		struct port_stats *ps = get_port_stats(dev, port);
+		int have = 0;
+		if(ps && ps->pool_retry_at > now) {
+			device_pool_schedule(dev, ps->pool_retry_at - now);
+			continue;
+		}
+		if(ps && ps->refused_until > now) {
+			device_pool_schedule(dev, ps->refused_until - now);
+			continue;
+		}
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			if(conn->pooled && conn->dport == port)
+				have++;
+		} ENDFOREACH
+		for(; have < conn_pool.entries[i].value; have++) {
+			if(connection_create(dev, port, NULL) < 0) {
+				device_pool_schedule(dev, POOL_RETRY);
+				break;
+			}
+		}
+	}
 }
 
 static int send_tcp_ack(struct mux_connection *conn)
@@ -456,6 +1510,27 @@ static int send_tcp_ack(struct mux_connection *conn)
 	return 0;
 }
 
+/**
+ * Send the client data collected in a connection's out-buffer
+ * to the device as a single TCP segment.
+ *
+ * @param conn The connection to flush.
+ * @return 0 on success (or if there was nothing to send), < 0 on error.
+ */
+static int connection_flush_output(struct mux_connection *conn)
+{
+	int res;
+	if(!conn->ob_size)
+		return 0;
+	res = send_tcp(conn, TH_ACK, conn->ob_buf, conn->ob_size);
+	if(res < 0)
+		return res;
+	conn->tx_seq += conn->ob_size;
+	conn->ob_size = 0;
+	conn->coalesce_deadline = 0;
+	return 0;
+}
+
 /**
  * Flush input and output buffers for a client connection.
  *
@@ -465,28 +1540,55 @@ static int send_tcp_ack(struct mux_connection *conn)
  *   the client is ready to receive data, POLLIN that it has
  *   data to be read (and send along to the device).
  */
+static void connection_client_process(struct mux_connection *conn, short events);
+
 void device_client_process(int device_id, struct mux_client *client, short events)
 {
-	mutex_lock(&device_list_mutex);
-	struct mux_connection *conn = get_mux_connection(device_id, client);
-	mutex_unlock(&device_list_mutex);
+	struct device_registry *reg = registry_enter();
+	struct mux_connection *conn = get_mux_connection(reg, device_id, client);
+	if(!conn)
+		conn = get_linger_connection(client);
 	if(!conn) {
+		registry_leave();
 		usbmuxd_log(LL_WARNING, "Could not find connection for device %d client %p", device_id, client);
 		return;
 	}
+	connection_client_process(conn, events);
+	registry_leave();
+}
+
+static void connection_client_process(struct mux_connection *conn, short events)
+{
 	usbmuxd_log(LL_SPEW, "device_client_process (%d)", events);
 
-	int res;
+	if(conn->state == CONN_LINGER) {
+		if(events & (POLLOUT | POLLERR | POLLHUP))
+			connection_linger_process(conn);
+		return;
+	}
+
 	int size;
 	if((events & POLLOUT) && conn->ib_size > 0) {
 		// Client is ready to receive data, send what we have
 		// in the client's connection buffer (if there is any)
-		size = client_write(conn->client, conn->ib_buf, conn->ib_size);
-		if(size <= 0) {
+		uint64_t now = ustime64();
+		int64_t avail = rate_available(&conn->rate_down, now);
+		int64_t dev_avail = rate_available(&conn->dev->rate_down, now);
+		if(dev_avail < avail)
+			avail = dev_avail;
+		uint32_t len = conn->ib_size;
+		if(avail < (int64_t)len)
+			len = (avail > 0) ? avail : 0;
+		size = len ? client_write(conn->client, conn->ib_buf, len) : 0;
+		if(len && size <= 0) {
 			usbmuxd_log(LL_DEBUG, "error writing to client (%d)", size);
 			connection_teardown(conn);
 			return;
 		}
+		rate_consume(&conn->rate_down, size);
+		rate_consume(&conn->dev->rate_down, size);
+		if(size > 0)
+			conn->last_activity = mstime64();
 		conn->tx_ack += size;
 		if(size == (int)conn->ib_size) {
 			conn->ib_size = 0;
@@ -495,27 +1597,198 @@ void device_client_process(int device_id, struct mux_client *client, short event
 			memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
 		}
 	}
-	if((events & POLLIN) && conn->sendable > 0) {
-		// There is inbound trafic on the client socket,
-		// convert it to tcp and send to the device
-		// (if the device's input buffer is not full)
-		size = client_read(conn->client, conn->ob_buf, conn->sendable);
-		if(size <= 0) {
-			if (size < 0) {
-				usbmuxd_log(LL_DEBUG, "error reading from client (%d)", size);
-			}
-			connection_teardown(conn);
-			return;
+	if((events & POLLIN) && conn->sendable > conn->ob_size) {
+		// There is inbound trafic on the client socket; it is read and
+		// sent to the device by the TX scheduler (see device_process_tx)
+		// so that connections sharing the device get their fair share
+		conn->flags |= CONN_TX_READY;
+	}
+
+	update_connection(conn);
+}
+
+/**
+ * Read data from a connection's client socket, convert it to tcp
+ * and send it to the device (if the device's input buffer is not full).
+ *
+ * @param conn The connection to read from.
+ * @param len Maximum number of bytes to read.
+ * @return Number of bytes read, 0 if the client had nothing to send,
+ *   or -1 if the connection was torn down.
+ */
+static int connection_client_input(struct mux_connection *conn, uint32_t len)
+{
+	int res;
+	if(conn_buf_reserve(conn->dev, &conn->ob_buf, &conn->ob_capacity, conn->ob_size + len, CONN_OUTBUF_SIZE) < 0) {
+		// read what fits, the rest stays in the socket
+		if(conn->ob_size + len > conn->ob_capacity)
+			len = conn->ob_capacity - conn->ob_size;
+		if(!len)
+			return 0;
+	}
+	int size = client_read(conn->client, conn->ob_buf + conn->ob_size, len);
+	if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if(size <= 0) {
+		if (size < 0) {
+			usbmuxd_log(LL_DEBUG, "error reading from client (%d)", size);
+		} else {
+			// pass on whatever the client wrote before closing
+			connection_flush_output(conn);
 		}
-		res = send_tcp(conn, TH_ACK, conn->ob_buf, size);
+		connection_teardown(conn);
+		return -1;
+	}
+	conn->ob_size += size;
+	conn->last_activity = mstime64();
+	rate_consume(&conn->rate_up, size);
+	rate_consume(&conn->dev->rate_up, size);
+	// Small writes are held back until enough data has been collected
+	// or the coalescing deadline expires (see device_check_timeouts)
+	if(!conn->coalesce_delay || conn->ob_size >= coalesce_size || conn->ob_size >= conn->sendable) {
+		res = connection_flush_output(conn);
 		if(res < 0) {
 			connection_teardown(conn);
-			return;
+			return -1;
 		}
-		conn->tx_seq += size;
+	} else if(!conn->coalesce_deadline) {
+		conn->coalesce_deadline = ustime64() + conn->coalesce_delay;
 	}
-
 	update_connection(conn);
+	return size;
+}
+
+/**
+ * Let a backlogged connection send up to its quantum, plus whatever
+ * it did not use in the previous round.
+ *
+ * @param conn The connection to serve.
+ * @return 1 if the connection still has data to send, 0 otherwise.
+ */
+static int connection_tx_serve(struct mux_connection *conn)
+{
+	// the device's rate limit is shared, pick up what others used
+	if(conn->dev->rate_up.rate)
+		update_connection(conn);
+	if(conn->state != CONN_CONNECTED || conn->sendable <= conn->ob_size) {
+		conn->flags &= ~CONN_TX_READY;
+		drr_reset(&conn->drr);
+		return 0;
+	}
+	drr_grant(&conn->drr);
+	// a single segment is limited to max_payload, keep reading
+	// until the quantum is used up so that weights take effect
+	while(conn->drr.deficit > 0) {
+		uint32_t len = drr_allowance(&conn->drr, conn->sendable - conn->ob_size);
+		int size = connection_client_input(conn, len);
+		if(size < 0)
+			return 0;
+		drr_charge(&conn->drr, size);
+		// connection_client_input() updated the window
+		if((uint32_t)size < len || conn->state != CONN_CONNECTED || conn->sendable <= conn->ob_size) {
+			// drained the socket or filled the window, done for this pass
+			conn->flags &= ~CONN_TX_READY;
+			drr_reset(&conn->drr);
+			return 0;
+		}
+	}
+	drr_carry(&conn->drr);
+	return 1;
+}
+
+/**
+ * Deficit round robin over the connections of a device that have
+ * client data waiting. Each round, every backlogged connection may
+ * send up to its quantum (TX_QUANTUM times its weight), in as many
+ * segments as that takes, plus whatever it did not use in the previous
+ * round. Each round starts one connection further into the list.
+ * Only connections of the given priority class take part.
+ *
+ * @param dev The device to schedule outgoing data for.
+ * @param priority The priority class to serve.
+ */
+static void device_tx_schedule(struct mux_device *dev, int priority)
+{
+	int backlog = 1;
+	while(backlog) {
+		int count = collection_count(&dev->connections);
+		int start, n;
+		backlog = 0;
+		if(!count)
+			break;
+		start = dev->tx_next % count;
+		// first the connections from the start position on, then
+		// the ones before it
+		n = 0;
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			if(n++ >= start && conn->priority == priority && (conn->flags & CONN_TX_READY))
+				backlog |= connection_tx_serve(conn);
+		} ENDFOREACH
+		n = 0;
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			if(n++ < start && conn->priority == priority && (conn->flags & CONN_TX_READY))
+				backlog |= connection_tx_serve(conn);
+		} ENDFOREACH
+		dev->tx_next = (start + 1) % count;
+	}
+}
+
+/**
+ * Send pending client data to the devices. Called once per
+ * main loop iteration after all client sockets were processed.
+ * Higher priority classes are drained first so their USB transfers
+ * get submitted ahead of bulk traffic.
+ */
+void device_process_tx(void)
+{
+	int i, prio;
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++) {
+		struct mux_device *dev = reg->devs[i];
+		if(dev->state != MUXDEV_ACTIVE)
+			continue;
+		for(prio = 0; prio < CONN_PRIO_COUNT; prio++)
+			device_tx_schedule(dev, prio);
+	}
+	registry_leave();
+}
+
+/**
+ * Send the small packets collected for packing. Called at the end of
+ * every main loop iteration.
+ */
+void device_tx_flush(void)
+{
+	int i;
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++)
+		device_tx_flush_staged(reg->devs[i]);
+	registry_leave();
+}
+
+/**
+ * Copy the first len bytes of a scatter list to a linear buffer.
+ */
+static void iov_copy(unsigned char *dst, const struct iovec *iov, int iovcnt, uint32_t len)
+{
+	int i;
+	for(i = 0; i < iovcnt && len > 0; i++) {
+		uint32_t n = iov[i].iov_len;
+		if(n > len)
+			n = len;
+		memcpy(dst, iov[i].iov_base, n);
+		dst += n;
+		len -= n;
+	}
+}
+
+static void device_rx_frags_free(struct mux_device *dev)
+{
+	int i;
+	for(i = 0; i < dev->rx_frag_count; i++)
+		bufpool_put(dev->rx_frags[i].iov_base);
+	dev->rx_frag_count = 0;
+	dev->pktlen = 0;
 }
 
 /**
@@ -535,28 +1808,32 @@ void device_client_process(int device_id, struct mux_client *client, short event
  * @param payload_length number of bytes to copy from from
  *   the payload.
  */
-static void connection_device_input(struct mux_connection *conn, unsigned char *payload, uint32_t payload_length)
+static void connection_device_input(struct mux_connection *conn, const struct iovec *payload, int payload_cnt, uint32_t payload_length)
 {
-	if((conn->ib_size + payload_length) > conn->ib_capacity) {
-		usbmuxd_log(LL_ERROR, "Input buffer overflow on device %d connection %d->%d (space=%d, payload=%d)", conn->dev->id, conn->sport, conn->dport, conn->ib_capacity-conn->ib_size, payload_length);
+	if(conn_buf_reserve(conn->dev, &conn->ib_buf, &conn->ib_capacity, conn->ib_size + payload_length, CONN_INBUF_SIZE) < 0) {
+		usbmuxd_log(LL_ERROR, "Input buffer overflow on device %d connection %d->%d (space=%d, payload=%d)", conn->dev->id, conn->sport, conn->dport, CONN_INBUF_SIZE-conn->ib_size, payload_length);
 		connection_teardown(conn);
 		return;
 	}
-	memcpy(conn->ib_buf + conn->ib_size, payload, payload_length);
+	iov_copy(conn->ib_buf + conn->ib_size, payload, payload_cnt, payload_length);
 	conn->ib_size += payload_length;
+	if(payload_length)
+		conn->last_activity = mstime64();
 	conn->rx_recvd += payload_length;
 	update_connection(conn);
 }
 
 void device_abort_connect(int device_id, struct mux_client *client)
 {
-	struct mux_connection *conn = get_mux_connection(device_id, client);
+	struct device_registry *reg = registry_enter();
+	struct mux_connection *conn = get_mux_connection(reg, device_id, client);
 	if (conn) {
 		conn->client = NULL;
 		connection_teardown(conn);
 	} else {
 		usbmuxd_log(LL_WARNING, "Attempted to abort for nonexistent connection for device %d", device_id);
 	}
+	registry_leave();
 }
 
 static void device_version_input(struct mux_device *dev, struct version_header *vh)
@@ -571,8 +1848,9 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 		usbmuxd_log(LL_ERROR, "Device %d has unknown version %d.%d", dev->id, vh->major, vh->minor);
 		mutex_lock(&device_list_mutex);
 		collection_remove(&device_list, dev);
+		registry_publish();
+		registry_retire_device(dev);
 		mutex_unlock(&device_list_mutex);
-		free(dev);
 		return;
 	}
 	dev->version = vh->major;
@@ -583,7 +1861,9 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 
 	usbmuxd_log(LL_NOTICE, "Connected to v%d.%d device %d on location 0x%x with serial number %s", dev->version, vh->minor, dev->id, usb_get_location(dev->usbdev), usb_get_serial(dev->usbdev));
 	dev->state = MUXDEV_ACTIVE;
-	collection_init(&dev->connections);
+	if(tx_packing)
+		device_pack_probe(dev);
+	device_pool_schedule(dev, 0);
 	struct device_info info;
 	info.id = dev->id;
 	info.location = usb_get_location(dev->usbdev);
@@ -635,7 +1915,7 @@ static void device_control_input(struct mux_device *dev, unsigned char *payload,
  * @param payload Payload data.
  * @param payload_length Number of bytes in payload.
  */
-static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned char *payload, uint32_t payload_length)
+static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, const struct iovec *payload, int payload_cnt, uint32_t payload_length)
 {
 	uint16_t sport = ntohs(th->th_dport);
 	uint16_t dport = ntohs(th->th_sport);
@@ -649,6 +1929,18 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 		return;
 	}
 
+	if(dev->pack_state == PACK_PROBING && dport == PACK_PROBE_DPORT && (sport & ~1) == PACK_PROBE_SPORT) {
+		// answer to the packing probe, refused or not does not matter
+		if(!(th->th_flags & TH_RST))
+			send_anon_rst(dev, sport, dport, ntohl(th->th_seq));
+		dev->pack_probe_seen |= 1 << (sport - PACK_PROBE_SPORT);
+		if(dev->pack_probe_seen == 3) {
+			usbmuxd_log(LL_NOTICE, "Device %d accepts packed transfers", dev->id);
+			dev->pack_state = PACK_ON;
+		}
+		return;
+	}
+
 	// Find the connection on this device that has the right sport and dport
 	FOREACH(struct mux_connection *lconn, &dev->connections) {
 		if(lconn->sport == sport && lconn->dport == dport) {
@@ -672,7 +1964,7 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 
 	if(th->th_flags & TH_RST) {
 		char *buf = malloc(payload_length+1);
-		memcpy(buf, payload, payload_length);
+		iov_copy((unsigned char*)buf, payload, payload_cnt, payload_length);
 		if(payload_length && (buf[payload_length-1] == '\n'))
 			buf[payload_length-1] = 0;
 		buf[payload_length] = 0;
@@ -682,11 +1974,30 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 
 	if(conn->state == CONN_CONNECTING) {
 		if(th->th_flags != (TH_SYN|TH_ACK)) {
-			if(th->th_flags & TH_RST)
+			if(th->th_flags & TH_RST) {
 				conn->state = CONN_REFUSED;
+				// only an RST is a refusal, anything else is a protocol error
+				struct port_stats *ps = get_port_stats(dev, dport);
+				if(ps) {
+					ps->refused++;
+					if(refused_cache_ttl)
+						ps->refused_until = mstime64() + refused_cache_ttl;
+				}
+			}
 			usbmuxd_log(LL_INFO, "Connection refused by device %d (%d->%d)", dev->id, sport, dport);
 			connection_teardown(conn); //this also sends the notification to the client
 		} else {
+			struct port_stats *ps = get_port_stats(dev, dport);
+			if(ps) {
+				uint64_t latency = ustime64() - conn->connect_start;
+				ps->connects++;
+				ps->syn_latency_total += latency;
+				if(latency < ps->syn_latency_min)
+					ps->syn_latency_min = latency;
+				if(latency > ps->syn_latency_max)
+					ps->syn_latency_max = latency;
+			}
+			conn->connect_deadline = 0;
 			conn->tx_seq++;
 			conn->tx_ack++;
 			conn->rx_recvd = conn->rx_seq;
@@ -696,6 +2007,13 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 				return;
 			}
 			conn->state = CONN_CONNECTED;
+			if(conn->pooled) {
+				usbmuxd_log(LL_DEBUG, "Pooled connection to device %d (%d->%d) ready", dev->id, sport, dport);
+				if(ps)
+					ps->pool_backoff = 0;
+				update_connection(conn);
+				return;
+			}
 			usbmuxd_log(LL_INFO, "Client connected to device %d (%d->%d)", dev->id, sport, dport);
 			if(client_notify_connect(conn->client, RESULT_OK) < 0) {
 				conn->client = NULL;
@@ -710,7 +2028,7 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 				conn->state = CONN_DYING;
 			connection_teardown(conn);
 		} else {
-			connection_device_input(conn, payload, payload_length);
+			connection_device_input(conn, payload, payload_cnt, payload_length);
 
 			// Device likes it best when we are prompty ACKing data
 			send_tcp_ack(conn);
@@ -719,70 +2037,19 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 }
 
 /**
- * Take input data from the device that has been read into a buffer
- * and dispatch it to the right protocol backend (eg. TCP).
+ * Handle a complete mux packet. The packet may be scattered over
+ * several RX transfer buffers, but the mux and TCP headers are always
+ * contained in the first one.
  *
- * @param usbdev
- * @param buffer
- * @param length
+ * @param dev The device the packet was received from.
+ * @param iov The buffers holding the packet.
+ * @param iovcnt Number of entries in iov.
+ * @param length Total length of the packet.
  */
-void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+static void device_packet_input(struct mux_device *dev, const struct iovec *iov, int iovcnt, uint32_t length)
 {
-	struct mux_device *dev = NULL;
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *tdev, &device_list) {
-		if(tdev->usbdev == usbdev) {
-			dev = tdev;
-			break;
-		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
-		return;
-	}
-
-	if(!length)
-		return;
-
-	// sanity check (should never happen with current USB implementation)
-	if((length > USB_MRU) || (length > DEV_MRU)) {
-		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
-		return;
-	}
-
-	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
-
-	// handle broken up transfers
-	if(dev->pktlen) {
-		if((length + dev->pktlen) > DEV_MRU) {
-			usbmuxd_log(LL_ERROR, "Incoming split packet is too large (%d so far), dropping!", length + dev->pktlen);
-			dev->pktlen = 0;
-			return;
-		}
-		memcpy(dev->pktbuf + dev->pktlen, buffer, length);
-		struct mux_header *mhdr = (struct mux_header *)dev->pktbuf;
-		if((length < USB_MRU) || (ntohl(mhdr->length) == (length + dev->pktlen))) {
-			buffer = dev->pktbuf;
-			length += dev->pktlen;
-			dev->pktlen = 0;
-			usbmuxd_log(LL_SPEW, "Gathered mux data from buffer (total size: %d)", length);
-		} else {
-			dev->pktlen += length;
-			usbmuxd_log(LL_SPEW, "Appended mux data to buffer (total size: %d)", dev->pktlen);
-			return;
-		}
-	} else {
-		struct mux_header *mhdr = (struct mux_header *)buffer;
-		if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-			memcpy(dev->pktbuf, buffer, length);
-			dev->pktlen = length;
-			usbmuxd_log(LL_SPEW, "Copied mux data to buffer (size: %d)", dev->pktlen);
-			return;
-		}
-	}
-
-	struct mux_header *mhdr = (struct mux_header *)buffer;
+	unsigned char *linear = NULL;
+	struct mux_header *mhdr = (struct mux_header *)iov[0].iov_base;
 	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
 	if(ntohl(mhdr->length) != length) {
 		usbmuxd_log(LL_ERROR, "Incoming packet size mismatch (dev %d, expected %d, got %d)", dev->id, ntohl(mhdr->length), length);
@@ -792,16 +2059,25 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 	struct tcphdr *th;
 	unsigned char *payload;
 	uint32_t payload_length;
+	struct iovec piov[DEV_RX_FRAGS];
 
 	if (dev->version >= 2) {
 		dev->rx_seq = ntohs(mhdr->rx_seq);
 	}
 
+	if(iovcnt > 1 && ntohl(mhdr->protocol) != MUX_PROTO_TCP) {
+		// only TCP payloads are handled in place, everything else
+		// is small and rare enough to simply be gathered
+		linear = malloc(length);
+		iov_copy(linear, iov, iovcnt, length);
+		mhdr = (struct mux_header *)linear;
+	}
+
 	switch(ntohl(mhdr->protocol)) {
 		case MUX_PROTO_VERSION:
 			if(length < (mux_header_size + sizeof(struct version_header))) {
 				usbmuxd_log(LL_ERROR, "Incoming version packet is too small (%d)", length);
-				return;
+				break;
 			}
 			device_version_input(dev, (struct version_header *)((char*)mhdr+mux_header_size));
 			break;
@@ -813,18 +2089,125 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 		case MUX_PROTO_TCP:
 			if(length < (mux_header_size + sizeof(struct tcphdr))) {
 				usbmuxd_log(LL_ERROR, "Incoming TCP packet is too small (%d)", length);
-				return;
+				break;
 			}
 			th = (struct tcphdr *)((char*)mhdr+mux_header_size);
-			payload = (unsigned char *)(th+1);
+			// the payload is handed on as a scatter list of the RX buffers
+			piov[0].iov_base = (unsigned char *)(th+1);
+			piov[0].iov_len = iov[0].iov_len - sizeof(struct tcphdr) - mux_header_size;
+			memcpy(piov + 1, iov + 1, (iovcnt - 1) * sizeof(struct iovec));
 			payload_length = length - sizeof(struct tcphdr) - mux_header_size;
-			device_tcp_input(dev, th, payload, payload_length);
+			device_tcp_input(dev, th, piov, iovcnt, payload_length);
 			break;
 		default:
 			usbmuxd_log(LL_ERROR, "Incoming packet for device %d has unknown protocol 0x%x)", dev->id, ntohl(mhdr->protocol));
 			break;
 	}
+	free(linear);
+}
+
+/**
+ * Feed data received from a device's USB endpoint into the mux layer.
+ *
+ * Mux packets larger than the device's RX transfer size (see
+ * usb_get_mru()) arrive split over several transfers.
+ * Instead of copying the pieces together, the transfer buffers
+ * themselves are kept until the packet is complete by taking a
+ * reference on them. The caller drops its own reference afterwards
+ * and resubmits the transfer with a new buffer.
+ *
+ * @param usbdev The USB device the data was received from.
+ * @param buffer The transfer buffer (from bufpool_get()).
+ * @param length Number of bytes received.
+ */
+static void mux_device_data_input(struct mux_device *dev, unsigned char *buffer, uint32_t length);
+
+void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+{
+	struct device_registry *reg = registry_enter();
+	struct mux_device *dev = get_mux_device_for_usbdev(reg, usbdev);
+	if(dev)
+		mux_device_data_input(dev, buffer, length);
+	else
+		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+	registry_leave();
+}
+
+static void mux_device_data_input(struct mux_device *dev, unsigned char *buffer, uint32_t length)
+{
+	uint32_t mru = usb_get_mru(dev->usbdev);
+
+	if(!length)
+		return;
+
+	// sanity check (should never happen with current USB implementation)
+	if((length > mru) || (length > DEV_MRU)) {
+		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
+		return;
+	}
+
+	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
+
+	// with large RX transfers every mux packet arrives in one piece
+	if(mru >= DEV_MRU) {
+		struct iovec iov = { buffer, length };
+		device_packet_input(dev, &iov, 1, length);
+		return;
+	}
+
+	// handle broken up transfers
+	if(dev->pktlen) {
+		if(((length + dev->pktlen) > DEV_MRU) || (dev->rx_frag_count == DEV_RX_FRAGS)) {
+			usbmuxd_log(LL_ERROR, "Incoming split packet is too large (%d so far), dropping!", length + dev->pktlen);
+			device_rx_frags_free(dev);
+			return;
+		}
+		bufpool_ref(buffer);
+		dev->rx_frags[dev->rx_frag_count].iov_base = buffer;
+		dev->rx_frags[dev->rx_frag_count].iov_len = length;
+		dev->rx_frag_count++;
+		dev->pktlen += length;
+		struct mux_header *mhdr = (struct mux_header *)dev->rx_frags[0].iov_base;
+		if((length < mru) || (ntohl(mhdr->length) == dev->pktlen)) {
+			usbmuxd_log(LL_SPEW, "Gathered mux data from %d transfers (total size: %d)", dev->rx_frag_count, dev->pktlen);
+			device_packet_input(dev, dev->rx_frags, dev->rx_frag_count, dev->pktlen);
+			device_rx_frags_free(dev);
+		} else {
+			usbmuxd_log(LL_SPEW, "Appended mux data to chain (total size: %d)", dev->pktlen);
+		}
+		return;
+	} else {
+		struct mux_header *mhdr = (struct mux_header *)buffer;
+		if((length == mru) && (length < ntohl(mhdr->length))) {
+			bufpool_ref(buffer);
+			dev->rx_frags[0].iov_base = buffer;
+			dev->rx_frags[0].iov_len = length;
+			dev->rx_frag_count = 1;
+			dev->pktlen = length;
+			usbmuxd_log(LL_SPEW, "Holding mux data for reassembly (size: %d)", dev->pktlen);
+			return;
+		}
+	}
+
+	struct iovec iov = { buffer, length };
+	device_packet_input(dev, &iov, 1, length);
+}
 
+/**
+ * Free a device and everything it owns, including its reference to the
+ * USB device. Only called for devices no registry reader can reference
+ * anymore (see registry_retire_device) or that were never published.
+ */
+static void device_free(struct mux_device *dev)
+{
+	collection_free(&dev->connections);
+	device_rx_frags_free(dev);
+	device_tx_flush_queue(dev);
+	free(dev->pack_buf);
+	conn_slabs_free(dev);
+	free_port_stats(dev);
+	usb_device_unref(dev->usbdev);
+	free(dev);
 }
 
 int device_add(struct usb_device *usbdev)
@@ -835,26 +2218,56 @@ int device_add(struct usb_device *usbdev)
 	usbmuxd_log(LL_NOTICE, "Connecting to new device on location 0x%x as ID %d", usb_get_location(usbdev), id);
 	dev = malloc(sizeof(struct mux_device));
 	dev->id = id;
+	// stays valid for readers of old snapshots, see device_free()
 	dev->usbdev = usbdev;
+	usb_device_ref(usbdev);
 	dev->state = MUXDEV_INIT;
 	dev->visible = 0;
+	collection_init(&dev->connections);
 	dev->next_sport = 1;
-	dev->pktbuf = malloc(DEV_MRU);
+	dev->rx_frag_count = 0;
 	dev->pktlen = 0;
 	dev->preflight_cb_data = NULL;
 	dev->version = 0;
+	dev->tx_next = 0;
+	dev->next_check = 0;
+	rate_init(&dev->rate_up, device_rate_up);
+	rate_init(&dev->rate_down, device_rate_down);
+	collection_init(&dev->port_stats);
+	dev->pool_refill_time = 0;
+	dev->reaped_conns = 0;
+	dev->reaped_bytes = 0;
+	memset(dev->txq_head, 0, sizeof(dev->txq_head));
+	memset(dev->txq_tail, 0, sizeof(dev->txq_tail));
+	dev->tx_queued = 0;
+	dev->tx_inflight = 0;
+	dev->tx_limit = tx_limit ? tx_limit : TX_LIMIT_DEFAULT;
+	dev->tx_latency = 0;
+	dev->pack_state = PACK_OFF;
+	dev->pack_probe_deadline = 0;
+	dev->pack_probe_seen = 0;
+	dev->pack_buf = NULL;
+	dev->pack_len = 0;
+	dev->pack_count = 0;
+	dev->packed_packets = 0;
+	dev->packed_transfers = 0;
+	dev->conn_slabs = NULL;
+	dev->conn_free = NULL;
+	dev->conn_free_bufs = 0;
+	dev->slab_mem = 0;
+	dev->buf_mem = 0;
 	struct version_header vh;
 	vh.major = htonl(2);
 	vh.minor = htonl(0);
 	vh.padding = 0;
 	if((res = send_packet(dev, MUX_PROTO_VERSION, &vh, NULL, 0)) < 0) {
 		usbmuxd_log(LL_ERROR, "Error sending version request packet to device %d", id);
-		free(dev->pktbuf);
-		free(dev);
+		device_free(dev);
 		return res;
 	}
 	mutex_lock(&device_list_mutex);
 	collection_add(&device_list, dev);
+	registry_publish();
 	mutex_unlock(&device_list_mutex);
 	return 0;
 }
@@ -871,15 +2284,15 @@ void device_remove(struct usb_device *usbdev)
 					connection_teardown(conn);
 				} ENDFOREACH
 				client_device_remove(dev->id);
-				collection_free(&dev->connections);
 			}
 			if (dev->preflight_cb_data) {
 				preflight_device_remove_cb(dev->preflight_cb_data);
 			}
 			collection_remove(&device_list, dev);
+			registry_publish();
+			// lookups on other threads might still hold the old snapshot
+			registry_retire_device(dev);
 			mutex_unlock(&device_list_mutex);
-			free(dev->pktbuf);
-			free(dev);
 			return;
 		}
 	} ENDFOREACH
@@ -890,18 +2303,22 @@ void device_remove(struct usb_device *usbdev)
 
 void device_set_visible(int device_id)
 {
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->id == device_id) {
-			dev->visible = 1;
+	int i;
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++) {
+		if(reg->devs[i]->id == device_id) {
+			reg->devs[i]->visible = 1;
 			break;
 		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
+	}
+	registry_leave();
 }
 
 void device_set_preflight_cb_data(int device_id, void* data)
 {
+	// serialized with device_remove(), which hands the pointer to
+	// preflight_device_remove_cb() while the preflight thread may be
+	// about to clear it
 	mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
 		if(dev->id == device_id) {
@@ -914,33 +2331,30 @@ void device_set_preflight_cb_data(int device_id, void* data)
 
 int device_get_count(int include_hidden)
 {
+	int i;
 	int count = 0;
-	struct collection dev_list = {NULL, 0};
-	mutex_lock(&device_list_mutex);
-	collection_copy(&dev_list, &device_list);
-	mutex_unlock(&device_list_mutex);
-
-	FOREACH(struct mux_device *dev, &dev_list) {
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++) {
+		struct mux_device *dev = reg->devs[i];
 		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible))
 			count++;
-	} ENDFOREACH
+	}
+	registry_leave();
 
-	collection_free(&dev_list);
 	return count;
 }
 
 int device_get_list(int include_hidden, struct device_info **devices)
 {
+	int i;
 	int count = 0;
-	struct collection dev_list = {NULL, 0};
-	mutex_lock(&device_list_mutex);
-	collection_copy(&dev_list, &device_list);
-	mutex_unlock(&device_list_mutex);
+	struct device_registry *reg = registry_enter();
 
-	*devices = malloc(sizeof(struct device_info) * dev_list.capacity);
+	*devices = malloc(sizeof(struct device_info) * (reg->count ? reg->count : 1));
 	struct device_info *p = *devices;
 
-	FOREACH(struct mux_device *dev, &dev_list) {
+	for(i = 0; i < reg->count; i++) {
+		struct mux_device *dev = reg->devs[i];
 		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible)) {
 			p->id = dev->id;
 			p->serial = usb_get_serial(dev->usbdev);
@@ -950,59 +2364,271 @@ int device_get_list(int include_hidden, struct device_info **devices)
 			count++;
 			p++;
 		}
-	} ENDFOREACH
-
-	collection_free(&dev_list);
+	}
+	registry_leave();
 
 	return count;
 }
 
+static plist_t rate_stats_plist(struct token_bucket *tb, uint64_t now)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Rate", plist_new_uint(tb->rate));
+	if(tb->rate)
+		plist_dict_set_item(dict, "Tokens", plist_new_int(rate_available(tb, now)));
+	plist_dict_set_item(dict, "Throttled", plist_new_uint(tb->throttled));
+	return dict;
+}
+
+/**
+ * Collect runtime statistics for all active devices and their
+ * connections.
+ *
+ * @return A plist array with one dictionary per device.
+ */
+plist_t device_get_stats(void)
+{
+	plist_t devices = plist_new_array();
+	uint64_t now = ustime64();
+	int i;
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++) {
+		struct mux_device *dev = reg->devs[i];
+		if(dev->state != MUXDEV_ACTIVE)
+			continue;
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "DeviceID", plist_new_uint(dev->id));
+		plist_dict_set_item(dict, "SerialNumber", plist_new_string(usb_get_serial(dev->usbdev)));
+		plist_dict_set_item(dict, "RateUp", rate_stats_plist(&dev->rate_up, now));
+		plist_dict_set_item(dict, "RateDown", rate_stats_plist(&dev->rate_down, now));
+		plist_dict_set_item(dict, "ReapedConnections", plist_new_uint(dev->reaped_conns));
+		plist_dict_set_item(dict, "ReapedBytes", plist_new_uint(dev->reaped_bytes));
+		plist_dict_set_item(dict, "TxInflight", plist_new_uint(dev->tx_inflight));
+		plist_dict_set_item(dict, "TxQueued", plist_new_uint(dev->tx_queued));
+		plist_dict_set_item(dict, "TxLimit", plist_new_uint(dev->tx_limit));
+		plist_dict_set_item(dict, "TxLatency", plist_new_uint(dev->tx_latency));
+		plist_dict_set_item(dict, "BufferMemory", plist_new_uint(dev->buf_mem));
+		plist_dict_set_item(dict, "SlabMemory", plist_new_uint(dev->slab_mem));
+		const struct usb_tx_stats *txs = usb_get_tx_stats(dev->usbdev);
+		plist_t usbtx = plist_new_dict();
+		plist_dict_set_item(dict, "UsbBackend", plist_new_string(usb_get_backend(dev->usbdev)));
+		plist_dict_set_item(usbtx, "Completions", plist_new_uint(txs->completions));
+		plist_dict_set_item(usbtx, "Bytes", plist_new_uint(txs->bytes));
+		plist_dict_set_item(usbtx, "Latency", plist_new_uint(txs->latency));
+		plist_dict_set_item(usbtx, "Timeouts", plist_new_uint(txs->timeouts));
+		plist_dict_set_item(usbtx, "Stalls", plist_new_uint(txs->stalls));
+		plist_dict_set_item(usbtx, "WatchdogFired", plist_new_uint(txs->watchdog));
+		plist_dict_set_item(usbtx, "Recoveries", plist_new_uint(txs->recoveries));
+		plist_dict_set_item(usbtx, "RecoveryFailures", plist_new_uint(txs->failures));
+		plist_dict_set_item(dict, "UsbTx", usbtx);
+		plist_dict_set_item(dict, "RxTransfers", plist_new_uint(usb_get_rx_depth(dev->usbdev)));
+		plist_dict_set_item(dict, "RxTransferSize", plist_new_uint(usb_get_mru(dev->usbdev)));
+		const struct usb_rx_stats *rxs = usb_get_rx_stats(dev->usbdev);
+		plist_t usbrx = plist_new_dict();
+		plist_dict_set_item(usbrx, "Completions", plist_new_uint(rxs->completions));
+		plist_dict_set_item(usbrx, "PipeEmpty", plist_new_uint(rxs->pipe_empty));
+		plist_dict_set_item(usbrx, "ProcessTime", plist_new_uint(rxs->process_time));
+		plist_dict_set_item(dict, "UsbRx", usbrx);
+		if(tx_packing) {
+			plist_dict_set_item(dict, "TxPacking", plist_new_bool(dev->pack_state == PACK_ON));
+			plist_dict_set_item(dict, "PackedPackets", plist_new_uint(dev->packed_packets));
+			plist_dict_set_item(dict, "PackedTransfers", plist_new_uint(dev->packed_transfers));
+		}
+		plist_t conns = plist_new_array();
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			plist_t c = plist_new_dict();
+			plist_dict_set_item(c, "SourcePort", plist_new_uint(conn->sport));
+			plist_dict_set_item(c, "DestinationPort", plist_new_uint(conn->dport));
+			plist_dict_set_item(c, "Priority", plist_new_uint(conn->priority));
+			plist_dict_set_item(c, "Pooled", plist_new_bool(conn->pooled));
+			plist_dict_set_item(c, "IdleTime", plist_new_uint(mstime64() - conn->last_activity));
+			plist_dict_set_item(c, "InBufferCapacity", plist_new_uint(conn->ib_capacity));
+			plist_dict_set_item(c, "OutBufferCapacity", plist_new_uint(conn->ob_capacity));
+			plist_dict_set_item(c, "RateUp", rate_stats_plist(&conn->rate_up, now));
+			plist_dict_set_item(c, "RateDown", rate_stats_plist(&conn->rate_down, now));
+			plist_array_append_item(conns, c);
+		} ENDFOREACH
+		plist_dict_set_item(dict, "Connections", conns);
+		plist_t ports = plist_new_array();
+		FOREACH(struct port_stats *ps, &dev->port_stats) {
+			plist_t p = plist_new_dict();
+			plist_dict_set_item(p, "Port", plist_new_uint(ps->port));
+			plist_dict_set_item(p, "Connects", plist_new_uint(ps->connects));
+			plist_dict_set_item(p, "Refused", plist_new_uint(ps->refused));
+			plist_dict_set_item(p, "Timeouts", plist_new_uint(ps->timeouts));
+			plist_dict_set_item(p, "RefusedCacheHits", plist_new_uint(ps->refused_hits));
+			plist_dict_set_item(p, "PoolHits", plist_new_uint(ps->pool_hits));
+			if(ps->connects) {
+				plist_dict_set_item(p, "SynLatencyMin", plist_new_uint(ps->syn_latency_min));
+				plist_dict_set_item(p, "SynLatencyAvg", plist_new_uint(ps->syn_latency_total / ps->connects));
+				plist_dict_set_item(p, "SynLatencyMax", plist_new_uint(ps->syn_latency_max));
+			}
+			plist_array_append_item(ports, p);
+		} ENDFOREACH
+		plist_dict_set_item(dict, "Ports", ports);
+		plist_array_append_item(devices, dict);
+	}
+	registry_leave();
+	return devices;
+}
+
 int device_get_timeout(void)
 {
-	uint64_t oldest = (uint64_t)-1LL;
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
+	uint64_t expiry = (uint64_t)-1LL; // in ms
+	int timeout = 100000; //meh
+	int i;
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		if(conn->linger_deadline < expiry)
+			expiry = conn->linger_deadline;
+	} ENDFOREACH
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++) {
+		struct mux_device *dev = reg->devs[i];
 		if(dev->state == MUXDEV_ACTIVE) {
-			FOREACH(struct mux_connection *conn, &dev->connections) {
-				if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING) && conn->last_ack_time < oldest)
-					oldest = conn->last_ack_time;
-			} ENDFOREACH
+			if(dev->pool_refill_time && dev->pool_refill_time < expiry)
+				expiry = dev->pool_refill_time;
+			if(dev->pack_state == PACK_PROBING && dev->pack_probe_deadline < expiry)
+				expiry = dev->pack_probe_deadline;
+			// the earliest connection deadline (see connection_next_check)
+			if(dev->next_check < expiry)
+				expiry = dev->next_check;
 		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
-	uint64_t ct = mstime64();
-	if((int64_t)oldest == -1LL)
-		return 100000; //meh
-	if((ct - oldest) > ACK_TIMEOUT)
-		return 0;
-	return ACK_TIMEOUT - (ct - oldest);
+	}
+	registry_leave();
+	if((int64_t)expiry != -1LL) {
+		uint64_t ct = mstime64();
+		if(expiry <= ct)
+			return 0;
+		if(expiry - ct < (uint64_t)timeout)
+			timeout = expiry - ct;
+	}
+	return timeout;
 }
 
 void device_check_timeouts(void)
 {
 	uint64_t ct = mstime64();
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->state == MUXDEV_ACTIVE) {
+	uint64_t ut = ustime64();
+	int i, prio;
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		if(conn->linger_deadline <= ct) {
+			usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after unsuccessfully attempting for %dms.", __func__, LINGER_TIMEOUT);
+			connection_linger_finish(conn);
+		}
+	} ENDFOREACH
+	struct device_registry *reg = registry_enter();
+	for(i = 0; i < reg->count; i++) {
+		struct mux_device *dev = reg->devs[i];
+		if(dev->state != MUXDEV_ACTIVE)
+			continue;
+		if(dev->pool_refill_time && dev->pool_refill_time <= ct) {
+			dev->pool_refill_time = 0;
+			device_pool_refill(dev);
+		}
+		if(dev->pack_state == PACK_PROBING && dev->pack_probe_deadline <= ct) {
+			usbmuxd_log(LL_NOTICE, "Device %d does not accept packed transfers, sending one packet per transfer", dev->id);
+			dev->pack_state = PACK_OFF;
+		}
+		// connection deadlines only move forward unless
+		// connection_arm_check() pulled next_check in
+		if(dev->next_check > ct)
+			continue;
+		dev->next_check = (uint64_t)-1LL;
+		// flush interactive connections before bulk ones
+		for(prio = 0; prio < CONN_PRIO_COUNT; prio++) {
 			FOREACH(struct mux_connection *conn, &dev->connections) {
+				if(conn->priority != prio)
+					continue;
+				if((conn->state == CONN_CONNECTING) && conn->connect_deadline && conn->connect_deadline <= ct) {
+					usbmuxd_log(LL_WARNING, "Connection to device %d port %d timed out after %u ms", dev->id, conn->dport, connect_timeout);
+					struct port_stats *ps = get_port_stats(dev, conn->dport);
+					if(ps)
+						ps->timeouts++;
+					connection_teardown(conn); // sends RST and notifies the client
+					continue;
+				}
+				if((conn->state == CONN_CONNECTED) && conn->idle_timeout && !conn->pooled && (conn->last_activity + conn->idle_timeout) <= ct) {
+					// the object stays in its slab, only count the
+					// buffer memory the teardown actually gives back
+					uint64_t buf_mem = dev->buf_mem;
+					usbmuxd_log(LL_NOTICE, "Closing connection %d->%d to device %d after %u s of inactivity", conn->sport, conn->dport, dev->id, conn->idle_timeout / 1000);
+					dev->reaped_conns++;
+					connection_teardown(conn);
+					if(dev->buf_mem < buf_mem)
+						dev->reaped_bytes += buf_mem - dev->buf_mem;
+					continue;
+				}
+				if(conn->last_activity + CONN_BUF_IDLE <= ct)
+					connection_shrink_buffers(conn);
+				if(conn->coalesce_deadline && conn->coalesce_deadline <= ut) {
+					usbmuxd_log(LL_SPEW, "Flushing %d coalesced bytes for connection %d->%d", conn->ob_size, conn->sport, conn->dport);
+					if(connection_flush_output(conn) < 0) {
+						connection_teardown(conn);
+						continue;
+					}
+					update_connection(conn);
+				}
+				if(conn->throttle_deadline && conn->throttle_deadline <= ut) {
+					// tokens are available again, resume polling the client
+					update_connection(conn);
+				}
 				if((conn->state == CONN_CONNECTED) &&
 						(conn->flags & CONN_ACK_PENDING) &&
 						(ct - conn->last_ack_time) > ACK_TIMEOUT) {
 					usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, ct);
 					send_tcp_ack(conn);
 				}
+				connection_arm_check(conn);
 			} ENDFOREACH
 		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
+	}
+	registry_leave();
+
+	// catch up on anything retired while a lookup was running
+	if(__atomic_load_n(&registry_retired_count, __ATOMIC_SEQ_CST)) {
+		mutex_lock(&device_list_mutex);
+		registry_reclaim();
+		mutex_unlock(&device_list_mutex);
+	}
 }
 
 void device_init(void)
 {
 	usbmuxd_log(LL_DEBUG, "device_init");
 	collection_init(&device_list);
+	collection_init(&linger_list);
+	collection_init(&registry_retired);
+	collection_init(&registry_retired_devs);
 	mutex_init(&device_list_mutex);
+	mutex_lock(&device_list_mutex);
+	registry_publish();
+	mutex_unlock(&device_list_mutex);
 	next_device_id = 1;
+
+	coalesce_delay = getenv_uint(ENV_COALESCE_DELAY, 0);
+	coalesce_size = getenv_uint(ENV_COALESCE_SIZE, COALESCE_SIZE);
+	port_map_parse(&coalesce_ports, getenv(ENV_COALESCE_PORTS));
+	if(coalesce_delay || coalesce_ports.count)
+		usbmuxd_log(LL_INFO, "Coalescing client writes below %u bytes for up to %u us", coalesce_size, coalesce_delay);
+
+	port_map_parse(&tx_weights, getenv(ENV_TX_WEIGHTS));
+	tx_max_inflight = getenv_uint(ENV_TX_MAX_INFLIGHT, 0);
+	port_map_parse(&port_priorities, getenv(ENV_PORT_PRIORITIES));
+
+	connect_timeout = getenv_uint(ENV_CONNECT_TIMEOUT, 0);
+	refused_cache_ttl = getenv_uint(ENV_REFUSED_CACHE_TTL, 0);
+	port_map_parse(&conn_pool, getenv(ENV_CONN_POOL));
+	idle_timeout = getenv_uint(ENV_IDLE_TIMEOUT, 0);
+	tx_limit = getenv_uint(ENV_DEVICE_TX_LIMIT, 0);
+	tx_packing = getenv_int(ENV_TX_PACKING, 0);
+	port_map_parse(&idle_ports, getenv(ENV_IDLE_PORTS));
+
+	conn_rate_up = getenv_uint(ENV_CONN_RATE_UP, 0);
+	conn_rate_down = getenv_uint(ENV_CONN_RATE_DOWN, 0);
+	device_rate_up = getenv_uint(ENV_DEVICE_RATE_UP, 0);
+	device_rate_down = getenv_uint(ENV_DEVICE_RATE_DOWN, 0);
+	if(conn_rate_up || conn_rate_down || device_rate_up || device_rate_down)
+		usbmuxd_log(LL_INFO, "Rate limits (bytes/s, up/down): connection %u/%u, device %u/%u", conn_rate_up, conn_rate_down, device_rate_up, device_rate_down);
 }
 
 void device_kill_connections(void)
@@ -1015,6 +2641,9 @@ void device_kill_connections(void)
 			} ENDFOREACH
 		}
 	} ENDFOREACH
+	FOREACH(struct mux_device *dev, &device_list) {
+		device_tx_flush_staged(dev);
+	} ENDFOREACH
 	// give USB a while to send the final connection RSTs and the like
 	usb_process_timeout(100);
 }
@@ -1027,11 +2656,28 @@ void device_shutdown(void)
 		FOREACH(struct mux_connection *conn, &dev->connections) {
 			connection_teardown(conn);
 		} ENDFOREACH
-		collection_free(&dev->connections);
 		collection_remove(&device_list, dev);
-		free(dev);
+		registry_publish();
+		registry_retire_device(dev);
+	} ENDFOREACH
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		// one last attempt, we are not going to wait for the client
+		client_write(conn->client, conn->ib_buf, conn->ib_size);
+		connection_linger_finish(conn);
 	} ENDFOREACH
+	collection_free(&linger_list);
+	registry_publish();
+	registry_reclaim();
+	free(device_registry);
+	device_registry = NULL;
 	mutex_unlock(&device_list_mutex);
 	mutex_destroy(&device_list_mutex);
+	collection_free(&registry_retired);
+	collection_free(&registry_retired_devs);
 	collection_free(&device_list);
+	port_map_free(&coalesce_ports);
+	port_map_free(&tx_weights);
+	port_map_free(&port_priorities);
+	port_map_free(&conn_pool);
+	port_map_free(&idle_ports);
 }
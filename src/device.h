@@ -20,9 +20,53 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 
+#include <plist/plist.h>
+
 #include "usb.h"
 #include "client.h"
 
+// Small-write coalescing for client->device traffic: delay in microseconds
+// (0 disables), flush threshold in bytes, and per-port delay overrides
+#define ENV_COALESCE_DELAY "USBMUXD_COALESCE_DELAY"
+#define ENV_COALESCE_SIZE "USBMUXD_COALESCE_SIZE"
+#define ENV_COALESCE_PORTS "USBMUXD_COALESCE_PORTS"
+
+// TX scheduling: per-port weights for the deficit round robin scheduler
+// and the maximum number of unacknowledged bytes per connection
+#define ENV_TX_WEIGHTS "USBMUXD_TX_WEIGHTS"
+#define ENV_TX_MAX_INFLIGHT "USBMUXD_TX_MAX_INFLIGHT"
+
+// Per-port priority classes, 0 (interactive) to 2 (bulk), default 1
+#define ENV_PORT_PRIORITIES "USBMUXD_PORT_PRIORITIES"
+
+// Milliseconds to wait for the device to accept a connection (0 waits forever)
+#define ENV_CONNECT_TIMEOUT "USBMUXD_CONNECT_TIMEOUT"
+
+// Milliseconds to remember a port the device refused (0 disables)
+#define ENV_REFUSED_CACHE_TTL "USBMUXD_REFUSED_CACHE_TTL"
+
+// Number of idle connections to keep open per device port, as PORT:COUNT
+#define ENV_CONN_POOL "USBMUXD_CONN_POOL"
+
+// Close connections without traffic after this many seconds (0 disables),
+// with per-port overrides as PORT:SECONDS
+#define ENV_IDLE_TIMEOUT "USBMUXD_IDLE_TIMEOUT"
+#define ENV_IDLE_PORTS "USBMUXD_IDLE_PORTS"
+
+// Fixed cap on the bytes in flight to a device's USB endpoint (0 adapts
+// the cap to the transfer completion latency)
+#define ENV_DEVICE_TX_LIMIT "USBMUXD_DEVICE_TX_LIMIT"
+
+// Experimental: send small packets to the device packed into one transfer
+#define ENV_TX_PACKING "USBMUXD_TX_PACKING"
+
+// Token bucket rate limits in bytes per second (0 means unlimited),
+// per connection and per device; up is host to device
+#define ENV_CONN_RATE_UP "USBMUXD_CONN_RATE_UP"
+#define ENV_CONN_RATE_DOWN "USBMUXD_CONN_RATE_DOWN"
+#define ENV_DEVICE_RATE_UP "USBMUXD_DEVICE_RATE_UP"
+#define ENV_DEVICE_RATE_DOWN "USBMUXD_DEVICE_RATE_DOWN"
+
 struct device_info {
 	int id;
 	const char *serial;
@@ -32,6 +76,7 @@ struct device_info {
 };
 
 void device_data_input(struct usb_device *dev, unsigned char *buf, uint32_t length);
+void device_tx_complete(struct usb_device *dev, uint32_t length, uint64_t latency);
 
 int device_add(struct usb_device *dev);
 void device_remove(struct usb_device *dev);
@@ -45,6 +90,10 @@ void device_set_preflight_cb_data(int device_id, void* data);
 
 int device_get_count(int include_hidden);
 int device_get_list(int include_hidden, struct device_info **devices);
+plist_t device_get_stats(void);
+
+void device_process_tx(void);
+void device_tx_flush(void);
 
 int device_get_timeout(void);
 void device_check_timeouts(void);
@@ -0,0 +1,64 @@
+/*
+ * drr.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "drr.h"
+
+/**
+ * @param weight Relative share of the flow, 1 if not positive.
+ * @param unit Quantum of a flow with weight 1, in bytes.
+ */
+void drr_init(struct drr_flow *flow, int weight, uint32_t unit)
+{
+	flow->quantum = ((weight > 0) ? weight : 1) * unit;
+	flow->deficit = 0;
+}
+
+// Start a scheduler visit of a backlogged flow
+void drr_grant(struct drr_flow *flow)
+{
+	flow->deficit += flow->quantum;
+}
+
+/**
+ * @return How much of avail the flow may send now.
+ */
+uint32_t drr_allowance(struct drr_flow *flow, uint32_t avail)
+{
+	return (avail < flow->deficit) ? avail : flow->deficit;
+}
+
+void drr_charge(struct drr_flow *flow, uint32_t sent)
+{
+	flow->deficit = (sent < flow->deficit) ? flow->deficit - sent : 0;
+}
+
+// The flow has nothing left to send, it does not keep its deficit
+void drr_reset(struct drr_flow *flow)
+{
+	flow->deficit = 0;
+}
+
+// End a visit of a flow that is still backlogged
+void drr_carry(struct drr_flow *flow)
+{
+	if(flow->deficit > flow->quantum)
+		flow->deficit = flow->quantum;
+}
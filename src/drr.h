@@ -0,0 +1,38 @@
+/*
+ * drr.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef DRR_H
+#define DRR_H
+
+#include <stdint.h>
+
+// Deficit round robin accounting of one flow. Each visit of the
+// scheduler grants the flow its quantum; what it does not send is
+// carried over to the next visit, up to one quantum.
+struct drr_flow {
+	uint32_t quantum;
+	uint32_t deficit;
+};
+
+void drr_init(struct drr_flow *flow, int weight, uint32_t unit);
+void drr_grant(struct drr_flow *flow);
+uint32_t drr_allowance(struct drr_flow *flow, uint32_t avail);
+void drr_charge(struct drr_flow *flow, uint32_t sent);
+void drr_reset(struct drr_flow *flow);
+void drr_carry(struct drr_flow *flow);
+
+#endif
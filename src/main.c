@@ -52,6 +52,7 @@
 #include "device.h"
 #include "client.h"
 #include "conf.h"
+#include "bufpool.h"
 
 static const char *socket_path = "/var/run/usbmuxd";
 #define DEFAULT_LOCKFILE "/var/run/usbmuxd.pid"
@@ -363,6 +364,7 @@ static int main_loop(int listenfd)
 				return -1;
 			}
 			device_check_timeouts();
+			device_tx_flush();
 		} else {
 			int done_usb = 0;
 			for(i=0; i<pollfds.count; i++) {
@@ -387,6 +389,9 @@ static int main_loop(int listenfd)
 					}
 				}
 			}
+			device_process_tx();
+			device_check_timeouts();
+			device_tx_flush();
 		}
 	}
 	fdlist_free(&pollfds);
@@ -874,6 +879,7 @@ int main(int argc, char *argv[])
 	}
 
 	client_init();
+	bufpool_init();
 	device_init();
 	usbmuxd_log(LL_INFO, "Initializing USB");
 	if((res = usb_init()) < 0)
@@ -903,6 +909,7 @@ int main(int argc, char *argv[])
 	device_kill_connections();
 	usb_shutdown();
 	device_shutdown();
+	bufpool_shutdown();
 	client_shutdown();
 	usbmuxd_log(LL_NOTICE, "Shutdown complete");
 
@@ -0,0 +1,82 @@
+/*
+ * ratelimit.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "ratelimit.h"
+#include "utils.h"
+
+void rate_init(struct token_bucket *tb, uint32_t rate)
+{
+	tb->rate = rate;
+	tb->burst = (uint64_t)rate * RATE_BURST_MS / 1000;
+	if(tb->burst < RATE_BURST_MIN)
+		tb->burst = RATE_BURST_MIN;
+	tb->tokens = tb->burst;
+	tb->last_refill = ustime64();
+	tb->throttled = 0;
+}
+
+/**
+ * Add the tokens accumulated since the last refill to a bucket.
+ *
+ * @return The number of bytes that may be transferred now, which is
+ *   negative while the bucket is in debt, or INT64_MAX if the bucket
+ *   is not rate limited.
+ */
+int64_t rate_available(struct token_bucket *tb, uint64_t now)
+{
+	if(!tb->rate)
+		return INT64_MAX;
+	uint64_t elapsed = now - tb->last_refill;
+	uint64_t fill = ((uint64_t)(tb->burst - tb->tokens) * 1000000 + tb->rate - 1) / tb->rate;
+	if(elapsed > fill) {
+		// idle for long enough to refill completely
+		elapsed = fill;
+		tb->last_refill = now - elapsed;
+	}
+	int64_t add = elapsed * tb->rate / 1000000;
+	if(add > 0) {
+		tb->tokens += add;
+		// keep the time that did not add up to a whole token yet
+		tb->last_refill += (uint64_t)add * 1000000 / tb->rate;
+	}
+	if(tb->tokens > tb->burst)
+		tb->tokens = tb->burst;
+	return tb->tokens;
+}
+
+void rate_consume(struct token_bucket *tb, uint32_t len)
+{
+	if(tb->rate)
+		tb->tokens -= len;
+}
+
+/**
+ * @return Microseconds until a bucket has tokens available again.
+ */
+uint64_t rate_wait(struct token_bucket *tb)
+{
+	if(!tb->rate || tb->tokens > 0)
+		return 0;
+	return ((uint64_t)(1 - tb->tokens) * 1000000 + tb->rate - 1) / tb->rate;
+}
@@ -0,0 +1,41 @@
+/*
+ * ratelimit.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// token bucket depth for rate limited connections and devices
+#define RATE_BURST_MS 100
+#define RATE_BURST_MIN 4096
+
+struct token_bucket
+{
+	uint32_t rate;		// bytes per second, 0 means unlimited
+	uint32_t burst;
+	int64_t tokens;
+	uint64_t last_refill;
+	uint64_t throttled;	// number of times the bucket ran dry
+};
+
+void rate_init(struct token_bucket *tb, uint32_t rate);
+int64_t rate_available(struct token_bucket *tb, uint64_t now);
+void rate_consume(struct token_bucket *tb, uint32_t len);
+uint64_t rate_wait(struct token_bucket *tb);
+
+#endif
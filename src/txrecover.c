@@ -0,0 +1,194 @@
+/*
+ * txrecover.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "txrecover.h"
+#include "log.h"
+#include "utils.h"
+
+/**
+ * Set up the recovery state of a device's OUT pipe.
+ *
+ * @param timeout ms a transfer may be in flight (0 for none), checked
+ *   by tx_recovery_check() for backends that do not time out transfers
+ *   themselves.
+ * @param watchdog ms without any completion after which the pipe is
+ *   considered stuck, 0 for none.
+ */
+void tx_recovery_init(struct tx_recovery *rec, uint8_t bus, uint8_t address, unsigned int timeout, unsigned int watchdog)
+{
+	memset(rec, 0, sizeof(struct tx_recovery));
+	rec->bus = bus;
+	rec->address = address;
+	rec->timeout = timeout;
+	rec->watchdog = watchdog;
+}
+
+/**
+ * Called when a transfer is submitted to an idle pipe, so the watchdog
+ * does not count the idle time.
+ */
+void tx_recovery_busy(struct tx_recovery *rec)
+{
+	rec->progress = mstime64();
+}
+
+/**
+ * Called for every transfer that made it to the device completely.
+ */
+void tx_recovery_done(struct tx_recovery *rec, uint32_t length, uint64_t latency)
+{
+	rec->progress = mstime64();
+	rec->tries = 0;
+	rec->stats.completions++;
+	rec->stats.bytes += length;
+	rec->stats.latency += latency;
+}
+
+/**
+ * Account for a transfer that timed out or stalled. The backend parks
+ * it and calls tx_recovery_stop() afterwards.
+ */
+void tx_recovery_failed(struct tx_recovery *rec, int stall)
+{
+	if(stall) {
+		usbmuxd_log(LL_WARNING, "TX transfer stalled for device %d-%d, recovering", rec->bus, rec->address);
+		rec->stats.stalls++;
+	} else {
+		usbmuxd_log(LL_WARNING, "TX transfer timed out for device %d-%d, recovering", rec->bus, rec->address);
+		rec->stats.timeouts++;
+	}
+}
+
+/**
+ * Enter recovery after a transfer was parked.
+ *
+ * @return 1 if the pipe was running and the backend has to stop the
+ *   transfers in flight now, so they cannot overtake the parked one.
+ */
+int tx_recovery_stop(struct tx_recovery *rec)
+{
+	if(rec->recovering)
+		return 0;
+	rec->recovering = 1;
+	return 1;
+}
+
+/**
+ * Check whether the pipe is stuck: no completion for the watchdog
+ * period, or a transfer in flight for longer than the timeout.
+ *
+ * @param busy Whether any transfer is in flight.
+ * @param oldest Submission time (us) of the oldest transfer in flight,
+ *   0 if the backend times out transfers itself.
+ * @return 1 if a recovery was started and the backend has to stop the
+ *   transfers in flight, 0 otherwise.
+ */
+int tx_recovery_check(struct tx_recovery *rec, int busy, uint64_t oldest)
+{
+	if(rec->recovering || !busy)
+		return 0;
+	if(rec->watchdog && mstime64() - rec->progress >= rec->watchdog) {
+		usbmuxd_log(LL_WARNING, "No TX completion from device %d-%d for %u ms, recovering", rec->bus, rec->address, rec->watchdog);
+		rec->stats.watchdog++;
+		return tx_recovery_stop(rec);
+	}
+	if(rec->timeout && oldest && ustime64() - oldest >= (uint64_t)rec->timeout * 1000) {
+		tx_recovery_failed(rec, 0);
+		return tx_recovery_stop(rec);
+	}
+	return 0;
+}
+
+/**
+ * Called once nothing is in flight anymore during a recovery, right
+ * before the backend clears the endpoint halt and resubmits the parked
+ * transfers. Transfers queued from now on are submitted directly again.
+ *
+ * @return 0 if the pipe is to be recovered, -1 if it was recovered too
+ *   often in a row and the device is to be given up.
+ */
+int tx_recovery_begin(struct tx_recovery *rec)
+{
+	if(++rec->tries > TX_RECOVER_MAX) {
+		usbmuxd_log(LL_ERROR, "TX pipe of device %d-%d is still stuck after %d recoveries, giving up", rec->bus, rec->address, TX_RECOVER_MAX);
+		rec->stats.failures++;
+		return -1;
+	}
+	rec->recovering = 0;
+	rec->progress = mstime64();
+	return 0;
+}
+
+/**
+ * Called with the outcome of clearing the halt and resubmitting.
+ */
+void tx_recovery_end(struct tx_recovery *rec, int res)
+{
+	if(res < 0) {
+		rec->stats.failures++;
+		return;
+	}
+	rec->stats.recoveries++;
+	usbmuxd_log(LL_NOTICE, "Recovered TX pipe of device %d-%d", rec->bus, rec->address);
+}
+
+/**
+ * @param busy Whether any transfer is in flight.
+ * @param oldest As for tx_recovery_check().
+ * @return Milliseconds until tx_recovery_check() or the recovery has to
+ *   run, or -1 if it can wait for the next completion.
+ */
+int tx_recovery_get_timeout(struct tx_recovery *rec, int busy, uint64_t oldest)
+{
+	uint64_t now, deadline = 0;
+	if(rec->recovering)
+		return busy ? -1 : 0;
+	if(!busy)
+		return -1;
+	if(rec->timeout && oldest)
+		deadline = oldest + (uint64_t)rec->timeout * 1000;
+	if(rec->watchdog) {
+		uint64_t wd = (rec->progress + rec->watchdog) * 1000;
+		if(!deadline || wd < deadline)
+			deadline = wd;
+	}
+	if(!deadline)
+		return -1;
+	now = ustime64();
+	return (deadline > now) ? (int)((deadline - now + 999) / 1000) : 0;
+}
+
+/**
+ * Cut off what the device already received from a parked transfer;
+ * mux TCP has no retransmission, so a packet must neither be lost nor
+ * sent twice.
+ *
+ * @return The remaining length.
+ */
+uint32_t tx_recovery_trim(unsigned char *buf, uint32_t length, uint32_t sent)
+{
+	if(sent > 0 && sent < length)
+		memmove(buf, buf + sent, length - sent);
+	return (sent < length) ? length - sent : 0;
+}
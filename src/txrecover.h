@@ -0,0 +1,66 @@
+/*
+ * txrecover.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TXRECOVER_H
+#define TXRECOVER_H
+
+#include <stdint.h>
+
+// how many times in a row a stuck TX pipe is recovered in place before
+// the device is given up
+#define TX_RECOVER_MAX 3
+
+// TX completions and stuck TX pipe events of a device
+struct usb_tx_stats {
+	uint64_t completions;
+	uint64_t bytes;
+	uint64_t latency;	// us from submission to completion, summed up
+	uint64_t timeouts;
+	uint64_t stalls;
+	uint64_t watchdog;
+	uint64_t recoveries;
+	uint64_t failures;
+};
+
+// Recovery of a device's stuck OUT pipe, shared by the libusb and usbfs
+// data paths. When a TX transfer times out or stalls, or none completed
+// for the watchdog period, the backend stops everything in flight and
+// parks the failed transfers. Once nothing is in flight anymore, the
+// endpoint halt is cleared and the parked transfers are resubmitted in
+// their original order.
+struct tx_recovery {
+	uint8_t bus, address;	// for log messages
+	unsigned int timeout;	// ms a transfer may be in flight, 0 for none
+	unsigned int watchdog;	// ms without a completion, 0 for none
+	uint64_t progress;	// ms, last completion or start of a busy period
+	int recovering;	// the pipe is stopped, transfers are parked
+	int tries;
+	struct usb_tx_stats stats;
+};
+
+void tx_recovery_init(struct tx_recovery *rec, uint8_t bus, uint8_t address, unsigned int timeout, unsigned int watchdog);
+void tx_recovery_busy(struct tx_recovery *rec);
+void tx_recovery_done(struct tx_recovery *rec, uint32_t length, uint64_t latency);
+void tx_recovery_failed(struct tx_recovery *rec, int stall);
+int tx_recovery_stop(struct tx_recovery *rec);
+int tx_recovery_check(struct tx_recovery *rec, int busy, uint64_t oldest);
+int tx_recovery_begin(struct tx_recovery *rec);
+void tx_recovery_end(struct tx_recovery *rec, int res);
+int tx_recovery_get_timeout(struct tx_recovery *rec, int busy, uint64_t oldest);
+uint32_t tx_recovery_trim(unsigned char *buf, uint32_t length, uint32_t sent);
+
+#endif
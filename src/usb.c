@@ -29,18 +29,28 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#endif
 
 #include <libusb.h>
 
 #include <libimobiledevice-glue/collection.h>
+#include <libimobiledevice-glue/thread.h>
 
 #include "usb.h"
 #include "log.h"
 #include "device.h"
 #include "utils.h"
+#include "bufpool.h"
+#include "usbfs.h"
 
 #if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
 #define HAVE_LIBUSB_HOTPLUG_API 1
+#define HAVE_LIBUSB_PORT_NUMBERS 1
 #endif
 
 // interval for device connection/disconnection polling, in milliseconds
@@ -49,21 +59,121 @@
 
 // Number of parallel bulk transfers we have running for reading data from the device.
 // Older versions of usbmuxd kept only 1, which leads to a mostly dormant USB port.
-// 3 seems to be an all round sensible number - giving better read perf than
-// Apples usbmuxd, at least.
+// 3 seems to be an all round sensible number for high speed - giving better read
+// perf than Apples usbmuxd, at least. SuperSpeed links need more to cover the
+// bandwidth-delay product, full speed ones get by with less.
 #define NUM_RX_LOOPS 3
+#define NUM_RX_LOOPS_FULL 2
+#define NUM_RX_LOOPS_SUPER 8
+#define NUM_RX_LOOPS_SUPER_PLUS 16
+#define NUM_RX_LOOPS_MAX 32
+
+// RX transfer size for low and full speed devices
+#define USB_MRU_FULL USB_MRU_MIN
+
+// with adaptive RX depth, the depth is reconsidered every RX_ADAPT_WINDOW
+// completions: one more transfer is added if more than RX_ADAPT_HIGH percent
+// of them arrived full while all others were still in flight, and one is
+// dropped (down to the initial depth) below RX_ADAPT_LOW percent
+#define RX_ADAPT_WINDOW 256
+#define RX_ADAPT_HIGH 90
+#define RX_ADAPT_LOW 10
+
+// number of devices whose mode and configuration are remembered, and
+// the longest port path from the root hub (USB allows 7 tiers)
+#define MODE_CACHE_SIZE 64
+#define USB_MAX_PORTS 7
+
+// What set up a device last time, keyed by model and location; the
+// serial tells whether the device at that location is still the same
+struct mode_cache_entry {
+	uint16_t vid, pid, bcd;
+	uint8_t bus;
+	uint8_t ports[USB_MAX_PORTS];
+	int num_ports;
+	char serial[256];
+	int desired_mode;
+	int configuration;
+	uint8_t interface, ep_in, ep_out;
+	uint16_t langid;
+	uint64_t last_used;	// 0 if unused
+};
+
+// how long a bus thread blocks in libusb before checking for shutdown (ms)
+#define USB_BUS_POLL_TIME 100
+
+// A completed transfer of a bus thread, or data received by an RX
+// transfer that the bus thread already resubmitted (buf set)
+struct usb_xfer_done {
+	struct libusb_transfer *xfer;
+	struct usb_device *dev;
+	unsigned char *buf;
+	uint32_t length;
+};
+
+// Completions of a bus thread, in completion order, waiting for the main
+// loop to run their callbacks or hand their data to the mux layer
+struct usb_xfer_queue {
+	struct usb_xfer_done *items;
+	int head, count, size;
+};
+
+// With per-bus threads (see ENV_USB_THREADS), every bus gets its own
+// libusb context and a thread that handles its events. The bus thread
+// reaps and resubmits RX transfers itself, see usb_defer_rx(); all other
+// callbacks and the received data are passed to the main loop, so the
+// mux layer and the rest of the per-device state stay single threaded.
+struct usb_bus {
+	uint8_t number;
+	libusb_context *ctx;
+	THREAD_T thread;
+	int quit;	// atomic, set by usb_stop_bus()
+	mutex_t lock;
+	struct usb_xfer_queue done;
+};
 
 struct usb_device {
 	libusb_device_handle *handle;
 	uint8_t bus, address;
+	struct usb_bus *worker;	// NULL if served from the default context
 	char serial[256];
 	int alive;
+	int rx_stop;	// no more RX resubmits by the bus thread, under worker->lock
+	int refs;	// usb.c holds one until usb_disconnect(), see usb_device_ref()
 	uint8_t interface, ep_in, ep_out;
 	struct collection rx_xfers;
 	struct collection tx_xfers;
+	// TX transfers held back while the OUT pipe is being recovered
+	struct collection tx_parked;
+	uint64_t tx_next_seq;
+	// OUT pipe recovery, also used by the usbfs pipe
+	struct tx_recovery tx;
+	int rx_depth;	// RX transfers kept in flight
+	int rx_depth_min;
+	uint32_t rx_size;	// size of each RX transfer
+	int rx_samples, rx_saturated;
+	struct usb_rx_stats rx_stats;
 	int wMaxPacketSize;
+	// bulk data path through usbfs instead of libusb, see ENV_USBFS
+	struct usbfs_pipe *usbfs;
 	uint64_t speed;
 	struct libusb_device_descriptor devdesc;
+	uint8_t ports[USB_MAX_PORTS];
+	int num_ports;
+	int configuration;
+	uint16_t langid;
+	// copy of the mode cache entry for this location, if any
+	struct mode_cache_entry cached;
+	int cache_hit;
+};
+
+// per TX transfer bookkeeping, passed as the transfer's user_data
+struct tx_context {
+	struct usb_device *dev;
+	uint64_t submit_time;
+	uint64_t seq;	// submission order, for resubmitting after a recovery
+	uint32_t length;	// original length, the transfer may be resubmitted partially
+	int zlp;	// a ZLP transfer has to follow this one
 };
 
 struct mode_context {
@@ -82,12 +192,304 @@ static int devlist_failures;
 static int device_polling;
 static int device_hotplug = 1;
 
+static unsigned int tx_timeout;
+static unsigned int tx_watchdog;
+
+static int rx_depth;
+static int rx_size;
+static int rx_adapt;
+static int rx_large;
+static int use_usbfs;
+static int usb_threads;
+static int mode_cache_enabled;
+static struct mode_cache_entry mode_cache[MODE_CACHE_SIZE];
+
+static struct collection bus_list;
+// written by bus threads to wake up the main loop
+static int usb_wake_fd[2] = { -1, -1 };
+// bus served by the current thread, NULL in the main thread
+static __thread struct usb_bus *usb_current_bus;
+
+static void *usb_bus_thread(void *arg)
+{
+	struct usb_bus *bus = arg;
+	int res;
+	usb_current_bus = bus;
+	while(!__atomic_load_n(&bus->quit, __ATOMIC_SEQ_CST)) {
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_BUS_POLL_TIME * 1000;
+		res = libusb_handle_events_timeout_completed(bus->ctx, &tv, NULL);
+		if(res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout for bus %d failed: %s", bus->number, libusb_error_name(res));
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Get the worker of a bus, starting it on first use.
+ *
+ * @return The bus, or NULL if its context or thread could not be set up.
+ */
+static struct usb_bus *usb_get_bus(uint8_t number)
+{
+	struct usb_bus *bus;
+	int res;
+	FOREACH(struct usb_bus *b, &bus_list) {
+		if(b->number == number)
+			return b;
+	} ENDFOREACH
+
+	bus = calloc(1, sizeof(struct usb_bus));
+	bus->number = number;
+	if((res = libusb_init(&bus->ctx)) != 0) {
+		usbmuxd_log(LL_ERROR, "libusb_init for bus %d failed: %s", number, libusb_error_name(res));
+		free(bus);
+		return NULL;
+	}
+	mutex_init(&bus->lock);
+	if((res = thread_new(&bus->thread, usb_bus_thread, bus)) != 0) {
+		usbmuxd_log(LL_ERROR, "Could not start thread for bus %d: %s", number, strerror(res));
+		mutex_destroy(&bus->lock);
+		libusb_exit(bus->ctx);
+		free(bus);
+		return NULL;
+	}
+	usbmuxd_log(LL_INFO, "Started USB thread for bus %d", number);
+	collection_add(&bus_list, bus);
+	return bus;
+}
+
+static void usb_stop_bus(struct usb_bus *bus)
+{
+	__atomic_store_n(&bus->quit, 1, __ATOMIC_SEQ_CST);
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(bus->ctx);
+#else
+	// libusb before 1.0.21 cannot interrupt the event handler, the
+	// thread only notices after up to USB_BUS_POLL_TIME
+#endif
+	thread_join(bus->thread);
+	thread_free(bus->thread);
+	libusb_exit(bus->ctx);
+	mutex_destroy(&bus->lock);
+	free(bus->done.items);
+	free(bus);
+}
+
+/**
+ * Look up a device of the default context in the context of its bus.
+ *
+ * @return The device with a reference held, or NULL.
+ */
+static libusb_device *usb_bus_find_device(struct usb_bus *bus, uint8_t address)
+{
+	libusb_device **devs;
+	libusb_device *found = NULL;
+	ssize_t cnt, i;
+	cnt = libusb_get_device_list(bus->ctx, &devs);
+	if(cnt < 0)
+		return NULL;
+	for(i = 0; i < cnt; i++) {
+		if(libusb_get_bus_number(devs[i]) == bus->number && libusb_get_device_address(devs[i]) == address) {
+			found = libusb_ref_device(devs[i]);
+			break;
+		}
+	}
+	libusb_free_device_list(devs, 1);
+	return found;
+}
+
+// Queue a completion for the main loop, with bus->lock held
+static void usb_queue_done(struct usb_bus *bus, struct libusb_transfer *xfer, struct usb_device *dev, unsigned char *buf, uint32_t length)
+{
+	struct usb_xfer_queue *q = &bus->done;
+	int wake;
+	if(q->count == q->size) {
+		if(q->head > 0) {
+			memmove(q->items, q->items + q->head, (q->count - q->head) * sizeof(*q->items));
+			q->count -= q->head;
+			q->head = 0;
+		} else {
+			q->size = q->size ? q->size * 2 : 64;
+			q->items = realloc(q->items, q->size * sizeof(*q->items));
+		}
+	}
+	wake = (q->head == q->count);
+	q->items[q->count].xfer = xfer;
+	q->items[q->count].dev = dev;
+	q->items[q->count].buf = buf;
+	q->items[q->count].length = length;
+	q->count++;
+	if(wake && write(usb_wake_fd[1], "", 1) < 0) {
+		// pipe full, the main loop is awake anyway
+	}
+}
+
+/**
+ * Called first thing in every transfer callback but rx_callback(). In a
+ * bus thread, the transfer is queued for the main loop instead of being
+ * handled.
+ *
+ * @return 1 if the transfer was deferred and the callback must return.
+ */
+static int usb_defer(struct libusb_transfer *xfer)
+{
+	struct usb_bus *bus = usb_current_bus;
+	if(!bus)
+		return 0;
+	mutex_lock(&bus->lock);
+	usb_queue_done(bus, xfer, NULL, NULL, 0);
+	mutex_unlock(&bus->lock);
+	return 1;
+}
+
+/**
+ * Called first thing in the RX callback. In a bus thread, a completed
+ * transfer goes back to the device with a fresh buffer right away and
+ * only the received data is queued for the main loop, so reaping and
+ * resubmitting the RX transfers of busy devices is spread over the bus
+ * threads. Anything else is deferred like in usb_defer().
+ *
+ * @return 1 if the transfer was deferred and the callback must return.
+ */
+static int usb_defer_rx(struct libusb_transfer *xfer)
+{
+	struct usb_bus *bus = usb_current_bus;
+	struct usb_device *dev = xfer->user_data;
+	unsigned char *buf = xfer->buffer;
+	uint32_t length = xfer->actual_length;
+	unsigned char *fresh = NULL;
+	if(!bus)
+		return 0;
+	// the RX depth is adapted in the main loop, see usb_rx_adapt()
+	if(xfer->status == LIBUSB_TRANSFER_COMPLETED && !rx_adapt)
+		fresh = bufpool_get(dev->rx_size);
+	mutex_lock(&bus->lock);
+	if(fresh && !dev->rx_stop) {
+		xfer->buffer = fresh;
+		if(libusb_submit_transfer(xfer) == 0) {
+			usb_queue_done(bus, xfer, dev, buf, length);
+			mutex_unlock(&bus->lock);
+			return 1;
+		}
+		// let the main loop retry and retire the slot if needed
+		xfer->buffer = buf;
+	}
+	usb_queue_done(bus, xfer, NULL, NULL, 0);
+	mutex_unlock(&bus->lock);
+	bufpool_put(fresh);
+	return 1;
+}
+
+static void rx_data(struct usb_device *dev, unsigned char *buf, uint32_t length);
+
+/**
+ * Run the callbacks of all transfers completed by the bus threads.
+ * Callbacks may drain recursively, e.g. while disconnecting a device.
+ */
+static void usb_drain_completions(void)
+{
+	char discard[64];
+	if(usb_wake_fd[0] < 0)
+		return;
+	while(read(usb_wake_fd[0], discard, sizeof(discard)) > 0);
+	FOREACH(struct usb_bus *bus, &bus_list) {
+		while(1) {
+			struct usb_xfer_done done;
+			mutex_lock(&bus->lock);
+			if(bus->done.head == bus->done.count) {
+				bus->done.head = bus->done.count = 0;
+				mutex_unlock(&bus->lock);
+				break;
+			}
+			done = bus->done.items[bus->done.head++];
+			mutex_unlock(&bus->lock);
+			if(done.buf)
+				rx_data(done.dev, done.buf, done.length);
+			else
+				done.xfer->callback(done.xfer);
+		}
+	} ENDFOREACH
+}
+
+// Drop queued completions of a device whose transfers are freed by force
+static void usb_forget_completions(struct usb_device *dev)
+{
+	struct usb_xfer_queue *q;
+	int i, n;
+	if(!dev->worker)
+		return;
+	q = &dev->worker->done;
+	mutex_lock(&dev->worker->lock);
+	for(i = n = q->head; i < q->count; i++) {
+		if(q->items[i].xfer->dev_handle != dev->handle)
+			q->items[n++] = q->items[i];
+		else
+			bufpool_put(q->items[i].buf);
+	}
+	q->count = n;
+	mutex_unlock(&dev->worker->lock);
+}
+
+/**
+ * Wait up to tv for transfer completions of a device and handle them.
+ */
+static int usb_wait_events(struct usb_device *dev, struct timeval *tv)
+{
+	if(dev->worker) {
+		struct pollfd pfd;
+		pfd.fd = usb_wake_fd[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		poll(&pfd, 1, tv->tv_sec * 1000 + tv->tv_usec / 1000);
+		usb_drain_completions();
+		return 0;
+	}
+	return libusb_handle_events_timeout(NULL, tv);
+}
+
+static void free_tx_transfer(struct libusb_transfer *xfer)
+{
+	if(xfer->buffer)
+		free(xfer->buffer);
+	free(xfer->user_data);
+	libusb_free_transfer(xfer);
+}
+
+/**
+ * Keep a device's struct around after usb_disconnect(). The getters
+ * then report it as gone, but the struct stays valid until the last
+ * usb_device_unref().
+ */
+void usb_device_ref(struct usb_device *dev)
+{
+	__atomic_add_fetch(&dev->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+void usb_device_unref(struct usb_device *dev)
+{
+	if(__atomic_sub_fetch(&dev->refs, 1, __ATOMIC_SEQ_CST) == 0)
+		free(dev);
+}
+
 static void usb_disconnect(struct usb_device *dev)
 {
 	if(!dev->handle) {
 		return;
 	}
 
+	// cancelled transfers must not be parked for recovery anymore
+	dev->alive = 0;
+	dev->tx.recovering = 0;
+	if(dev->worker)
+		mutex_lock(&dev->worker->lock);
+	dev->rx_stop = 1;
+	if(dev->worker)
+		mutex_unlock(&dev->worker->lock);
+
 	// kill the rx xfer and tx xfers and try to make sure the callbacks
 	// get called before we free the device
 	FOREACH(struct libusb_transfer *xfer, &dev->rx_xfers) {
@@ -123,7 +525,7 @@ static void usb_disconnect(struct usb_device *dev)
 
         tv.tv_sec = 0;
         tv.tv_usec = wait_step_us;
-        if((res = libusb_handle_events_timeout(NULL, &tv)) < 0) {
+        if((res = usb_wait_events(dev, &tv)) < 0) {
             usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout for usb_disconnect failed: %s", libusb_error_name(res));
             break;
         }
@@ -134,30 +536,37 @@ static void usb_disconnect(struct usb_device *dev)
     if(collection_count(&dev->rx_xfers) || collection_count(&dev->tx_xfers)) {
         usbmuxd_log(LL_WARNING, "Some transfers failed to complete during disconnect for device %d-%d - forcing cleanup", 
                     dev->bus, dev->address);
-                    
+        usb_forget_completions(dev);
+
         // Force cleanup of any remaining transfers
         FOREACH(struct libusb_transfer *xfer, &dev->rx_xfers) {
-        if(xfer->buffer)
-            free(xfer->buffer);
+            bufpool_put(xfer->buffer);
             libusb_free_transfer(xfer);
         } ENDFOREACH
         collection_init(&dev->rx_xfers); // reinitialize to clear all entries
         
         FOREACH(struct libusb_transfer *xfer, &dev->tx_xfers) {
-            if(xfer->buffer)
-                free(xfer->buffer);
-            libusb_free_transfer(xfer);
+            free_tx_transfer(xfer);
         } ENDFOREACH
         collection_init(&dev->tx_xfers); // reinitialize to clear all entries
     }
 
+	FOREACH(struct libusb_transfer *xfer, &dev->tx_parked) {
+		free_tx_transfer(xfer);
+	} ENDFOREACH
+	collection_free(&dev->tx_parked);
 	collection_free(&dev->tx_xfers);
 	collection_free(&dev->rx_xfers);
-	libusb_release_interface(dev->handle, dev->interface);
+	if(dev->usbfs) {
+		usbfs_close(dev->usbfs);
+		dev->usbfs = NULL;
+	} else {
+		libusb_release_interface(dev->handle, dev->interface);
+	}
 	libusb_close(dev->handle);
 	dev->handle = NULL;
 	collection_remove(&device_list, dev);
-	free(dev);
+	usb_device_unref(dev);
 }
 
 static void reap_dead_devices(void) {
@@ -169,12 +578,74 @@ static void reap_dead_devices(void) {
 	} ENDFOREACH
 }
 
+/**
+ * Hold back a TX transfer that timed out, stalled or was cancelled for
+ * a recovery, so it can be resubmitted once the OUT pipe was reset.
+ * Whatever the device already received is cut off the front.
+ *
+ * @return 1 if the transfer was parked, 0 if the device is to be
+ *   given up.
+ */
+// Cancel all TX transfers in flight for a recovery
+static void usb_tx_stop(struct usb_device *dev)
+{
+	FOREACH(struct libusb_transfer *xfer, &dev->tx_xfers) {
+		libusb_cancel_transfer(xfer);
+	} ENDFOREACH
+}
+
+static int tx_park(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	if(!dev->alive)
+		return 0;
+	switch(xfer->status) {
+		case LIBUSB_TRANSFER_TIMED_OUT:
+		case LIBUSB_TRANSFER_STALL:
+			tx_recovery_failed(&dev->tx, xfer->status == LIBUSB_TRANSFER_STALL);
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			if(!dev->tx.recovering)
+				return 0;
+			break;
+		default:
+			return 0;
+	}
+	xfer->length = tx_recovery_trim(xfer->buffer, xfer->length, xfer->actual_length);
+	// the ZLP queued behind the packet does not survive the recovery
+	// (see usb_tx_recover), a new one is sent if the rest still needs it
+	struct tx_context *ctx = xfer->user_data;
+	ctx->zlp = ctx->zlp && (xfer->length % dev->wMaxPacketSize == 0);
+	collection_remove(&dev->tx_xfers, xfer);
+	collection_add(&dev->tx_parked, xfer);
+	// stop the transfers queued behind this one right away so they
+	// cannot overtake it
+	if(tx_recovery_stop(&dev->tx))
+		usb_tx_stop(dev);
+	return 1;
+}
+
 // Callback from write operation
 static void tx_callback(struct libusb_transfer *xfer)
 {
-	struct usb_device *dev = xfer->user_data;
+	struct tx_context *ctx = xfer->user_data;
+	struct usb_device *dev = ctx->dev;
+	if(usb_defer(xfer))
+		return;
 	usbmuxd_log(LL_SPEW, "TX callback dev %d-%d len %d -> %d status %d", dev->bus, dev->address, xfer->length, xfer->actual_length, xfer->status);
-	if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	int done = (xfer->status == LIBUSB_TRANSFER_COMPLETED);
+	if(!done && xfer->actual_length >= xfer->length) {
+		// a transfer that would be parked for a recovery may still
+		// have made it to the device completely (see tx_park)
+		if(xfer->status == LIBUSB_TRANSFER_TIMED_OUT || xfer->status == LIBUSB_TRANSFER_STALL || (xfer->status == LIBUSB_TRANSFER_CANCELLED && dev->tx.recovering))
+			done = 1;
+	}
+	if(done) {
+		// ZLPs are not counted, usbfs has the kernel send them
+		if(ctx->length)
+			tx_recovery_done(&dev->tx, ctx->length, ustime64() - ctx->submit_time);
+	} else if(tx_park(dev, xfer)) {
+		return;
+	} else {
 		switch(xfer->status) {
 			case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
 			case LIBUSB_TRANSFER_ERROR:
@@ -206,49 +677,234 @@ static void tx_callback(struct libusb_transfer *xfer)
 		// we'll do device_remove there too
 		dev->alive = 0;
 	}
-	if(xfer->buffer)
-		free(xfer->buffer);
+	if(ctx->length)
+		device_tx_complete(dev, ctx->length, ustime64() - ctx->submit_time);
 	collection_remove(&dev->tx_xfers, xfer);
-	libusb_free_transfer(xfer);
+	free_tx_transfer(xfer);
 }
 
-int usb_send(struct usb_device *dev, const unsigned char *buf, int length)
+static int submit_tx_transfer(struct usb_device *dev, unsigned char *buf, int length, int zlp)
 {
 	int res;
 	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_out, (void*)buf, length, tx_callback, dev, 0);
+	struct tx_context *ctx = malloc(sizeof(struct tx_context));
+	ctx->dev = dev;
+	ctx->submit_time = ustime64();
+	ctx->seq = dev->tx_next_seq++;
+	ctx->length = length;
+	ctx->zlp = zlp;
+	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_out, buf, length, tx_callback, ctx, dev->tx.timeout);
+	if(dev->tx.recovering) {
+		// keep the order, this goes out after the parked ones
+		collection_add(&dev->tx_parked, xfer);
+		return 0;
+	}
+	if(!collection_count(&dev->tx_xfers))
+		tx_recovery_busy(&dev->tx);
 	if((res = libusb_submit_transfer(xfer)) < 0) {
-		usbmuxd_log(LL_ERROR, "Failed to submit TX transfer %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, libusb_error_name(res));
 		libusb_free_transfer(xfer);
+		free(ctx);
 		return res;
 	}
 	collection_add(&dev->tx_xfers, xfer);
-	if (length % dev->wMaxPacketSize == 0) {
-		usbmuxd_log(LL_DEBUG, "Send ZLP");
-		// Send Zero Length Packet
-		xfer = libusb_alloc_transfer(0);
-		void *buffer = malloc(1);
-		libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_out, buffer, 0, tx_callback, dev, 0);
-		if((res = libusb_submit_transfer(xfer)) < 0) {
-			usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
-			libusb_free_transfer(xfer);
+	return 0;
+}
+
+/**
+ * Send the Zero Length Packet that ends a packet whose length is a
+ * multiple of the endpoint's packet size.
+ */
+static int submit_tx_zlp(struct usb_device *dev)
+{
+	int res;
+	void *buffer = malloc(1);
+	if((res = submit_tx_transfer(dev, buffer, 0, 0)) < 0) {
+		usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+		free(buffer);
+	}
+	return res;
+}
+
+/**
+ * Try to get a stuck OUT pipe going again without dropping the device:
+ * once the cancelled transfers came back, clear the endpoint halt and
+ * resubmit the parked transfers in their original order. Runs from
+ * usb_process(), outside of the libusb callbacks, as libusb_clear_halt()
+ * is synchronous.
+ */
+static void usb_tx_recover(struct usb_device *dev)
+{
+	int res;
+	if(collection_count(&dev->tx_xfers))
+		return;
+	if(tx_recovery_begin(&dev->tx) < 0) {
+		dev->alive = 0;
+		return;
+	}
+	res = libusb_clear_halt(dev->handle, dev->ep_out);
+	if(res < 0) {
+		usbmuxd_log(LL_ERROR, "Could not clear halt on TX endpoint of device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+		tx_recovery_end(&dev->tx, res);
+		dev->alive = 0;
+		return;
+	}
+	while(collection_count(&dev->tx_parked)) {
+		struct libusb_transfer *next = NULL;
+		FOREACH(struct libusb_transfer *xfer, &dev->tx_parked) {
+			if(!next || ((struct tx_context*)xfer->user_data)->seq < ((struct tx_context*)next->user_data)->seq)
+				next = xfer;
+		} ENDFOREACH
+		struct tx_context *ctx = next->user_data;
+		collection_remove(&dev->tx_parked, next);
+		if(!ctx->length) {
+			// ZLPs are sent again along with their packet below
+			free_tx_transfer(next);
+			continue;
+		}
+		ctx->submit_time = ustime64();
+		if((res = libusb_submit_transfer(next)) < 0) {
+			usbmuxd_log(LL_ERROR, "Failed to resubmit TX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+			free_tx_transfer(next);
+			tx_recovery_end(&dev->tx, res);
+			dev->alive = 0;
+			return;
+		}
+		collection_add(&dev->tx_xfers, next);
+		if(ctx->zlp)
+			submit_tx_zlp(dev);
+	}
+	tx_recovery_end(&dev->tx, 0);
+}
+
+/**
+ * Check for devices whose TX transfers stopped completing and run
+ * pending pipe recoveries.
+ */
+static void usb_check_tx(void)
+{
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(!usbdev->alive || !usbdev->handle || usbdev->usbfs)
+			continue;
+		// libusb times out the transfers itself
+		if(tx_recovery_check(&usbdev->tx, collection_count(&usbdev->tx_xfers) > 0, 0))
+			usb_tx_stop(usbdev);
+		if(usbdev->tx.recovering)
+			usb_tx_recover(usbdev);
+	} ENDFOREACH
+}
+
+int usb_send(struct usb_device *dev, const unsigned char *buf, int length)
+{
+	int res;
+	if(dev->usbfs) {
+		if((res = usbfs_send(dev->usbfs, (unsigned char*)buf, length)) < 0) {
+			usbmuxd_log(LL_ERROR, "Failed to submit TX URB %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, strerror(-res));
 			return res;
 		}
-		collection_add(&dev->tx_xfers, xfer);
+		return 0;
+	}
+	int zlp = (length % dev->wMaxPacketSize == 0);
+	if((res = submit_tx_transfer(dev, (unsigned char*)buf, length, zlp)) < 0) {
+		usbmuxd_log(LL_ERROR, "Failed to submit TX transfer %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, libusb_error_name(res));
+		return res;
+	}
+	if (zlp) {
+		usbmuxd_log(LL_DEBUG, "Send ZLP");
+		// the packet itself is on its way and owned by its transfer
+		// now, so a failed ZLP must not make the caller free it
+		submit_tx_zlp(dev);
+	}
+	return 0;
+}
+
+static int start_rx_loop(struct usb_device *dev);
+
+/**
+ * Track how busy the RX transfers of a device are and add or drop one
+ * when the IN pipe is saturated or mostly idle.
+ *
+ * @param dev The device.
+ * @param full Whether the completed transfer filled its buffer.
+ * @param pending Number of RX transfers in flight including the
+ *   completed one.
+ * @return 1 if the completed transfer should not be resubmitted.
+ */
+static int usb_rx_adapt(struct usb_device *dev, int full, int pending)
+{
+	int pct;
+	dev->rx_samples++;
+	if(full && pending >= dev->rx_depth)
+		dev->rx_saturated++;
+	if(dev->rx_samples < RX_ADAPT_WINDOW)
+		return 0;
+	pct = dev->rx_saturated * 100 / dev->rx_samples;
+	dev->rx_samples = 0;
+	dev->rx_saturated = 0;
+	if(pct > RX_ADAPT_HIGH && dev->rx_depth < NUM_RX_LOOPS_MAX) {
+		if(start_rx_loop(dev) == 0) {
+			dev->rx_depth++;
+			usbmuxd_log(LL_DEBUG, "RX pipe of device %d-%d is saturated, now using %d transfers", dev->bus, dev->address, dev->rx_depth);
+		}
+	} else if(pct < RX_ADAPT_LOW && dev->rx_depth > dev->rx_depth_min) {
+		dev->rx_depth--;
+		usbmuxd_log(LL_DEBUG, "RX pipe of device %d-%d is mostly idle, now using %d transfers", dev->bus, dev->address, dev->rx_depth);
+		return 1;
 	}
 	return 0;
 }
 
+// Hand data received by an RX transfer to the mux layer and drop the
+// USB layer's reference to its buffer
+static void rx_data(struct usb_device *dev, unsigned char *buf, uint32_t length)
+{
+	uint64_t start;
+	dev->rx_stats.completions++;
+	if(collection_count(&dev->rx_xfers) <= 1)
+		dev->rx_stats.pipe_empty++;
+	start = ustime64();
+	device_data_input(dev, buf, length);
+	dev->rx_stats.process_time += ustime64() - start;
+	// the mux layer holds its own reference if it kept the buffer
+	bufpool_put(buf);
+}
+
 // Callback from read operation
 // Under normal operation this issues a new read transfer request immediately,
-// doing a kind of read-callback loop
+// doing a kind of read-callback loop. The transfer goes back to the device
+// with a fresh buffer before the received data is processed, so the slot
+// does not sit idle while the mux layer and the clients are busy.
 static void rx_callback(struct libusb_transfer *xfer)
 {
 	struct usb_device *dev = xfer->user_data;
+	if(usb_defer_rx(xfer))
+		return;
 	usbmuxd_log(LL_SPEW, "RX callback dev %d-%d len %d status %d", dev->bus, dev->address, xfer->actual_length, xfer->status);
 	if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-		device_data_input(dev, xfer->buffer, xfer->actual_length);
-		libusb_submit_transfer(xfer);
+		int res;
+		int pending = collection_count(&dev->rx_xfers);
+		unsigned char *buf = xfer->buffer;
+		uint32_t length = xfer->actual_length;
+
+		if(dev->rx_stop || (rx_adapt && usb_rx_adapt(dev, length == dev->rx_size, pending))) {
+			collection_remove(&dev->rx_xfers, xfer);
+			libusb_free_transfer(xfer);
+		} else {
+			// an allocation failure retires the slot like a failed resubmit
+			if(!(xfer->buffer = bufpool_get(dev->rx_size)))
+				res = LIBUSB_ERROR_NO_MEM;
+			else
+				res = libusb_submit_transfer(xfer);
+			if(res < 0) {
+				usbmuxd_log(LL_ERROR, "Failed to resubmit RX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+				bufpool_put(xfer->buffer);
+				collection_remove(&dev->rx_xfers, xfer);
+				libusb_free_transfer(xfer);
+				if(!collection_count(&dev->rx_xfers))
+					dev->alive = 0;
+			}
+		}
+
+		rx_data(dev, buf, length);
 	} else {
 		switch(xfer->status) {
 			case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
@@ -278,7 +934,7 @@ static void rx_callback(struct libusb_transfer *xfer)
 				break;
 		}
 
-		free(xfer->buffer);
+		bufpool_put(xfer->buffer);
 		collection_remove(&dev->rx_xfers, xfer);
 		libusb_free_transfer(xfer);
 
@@ -294,10 +950,16 @@ static int start_rx_loop(struct usb_device *dev)
 	int res;
 	void *buf;
 	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
-	buf = malloc(USB_MRU);
-	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_in, buf, USB_MRU, rx_callback, dev, 0);
+	buf = bufpool_get(dev->rx_size);
+	if(!buf) {
+		usbmuxd_log(LL_ERROR, "Failed to allocate RX buffer for device %d-%d", dev->bus, dev->address);
+		libusb_free_transfer(xfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_in, buf, dev->rx_size, rx_callback, dev, 0);
 	if((res = libusb_submit_transfer(xfer)) != 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit RX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+		bufpool_put(buf);
 		libusb_free_transfer(xfer);
 		return res;
 	}
@@ -307,10 +969,140 @@ static int start_rx_loop(struct usb_device *dev)
 	return 0;
 }
 
+/**
+ * Hand the mux interface of a device over to usbfs. Must be done before
+ * the first transfer on it; if usbfs cannot take it, libusb keeps it.
+ */
+static void usb_start_usbfs(struct usb_device *dev)
+{
+	int res = libusb_release_interface(dev->handle, dev->interface);
+	if(res != 0) {
+		usbmuxd_log(LL_WARNING, "Could not release interface %d of device %d-%d for usbfs: %s", dev->interface, dev->bus, dev->address, libusb_error_name(res));
+		return;
+	}
+	// usb_check_tx() only watches libusb transfers, the pipe runs the
+	// TX recovery itself
+	dev->usbfs = usbfs_open(dev, dev->bus, dev->address, dev->interface, dev->ep_in, dev->ep_out, dev->wMaxPacketSize, dev->rx_depth, dev->rx_size, &dev->rx_stats, &dev->tx);
+	if(dev->usbfs)
+		return;
+	usbmuxd_log(LL_WARNING, "Falling back to libusb data path for device %d-%d", dev->bus, dev->address);
+	if((res = libusb_claim_interface(dev->handle, dev->interface)) != 0) {
+		usbmuxd_log(LL_ERROR, "Could not reclaim interface %d of device %d-%d: %s", dev->interface, dev->bus, dev->address, libusb_error_name(res));
+		dev->alive = 0;
+	}
+}
+
+static int usb_desired_mode(void)
+{
+	char* desired_mode_char = getenv(ENV_DEVICE_MODE);
+	return desired_mode_char ? atoi(desired_mode_char) : 1;
+}
+
+static int mode_cache_match(struct mode_cache_entry *entry, struct usb_device *dev)
+{
+	return entry->last_used &&
+		entry->vid == dev->devdesc.idVendor &&
+		entry->pid == dev->devdesc.idProduct &&
+		entry->bcd == dev->devdesc.bcdDevice &&
+		entry->bus == dev->bus &&
+		entry->num_ports == dev->num_ports &&
+		!memcmp(entry->ports, dev->ports, dev->num_ports);
+}
+
+/**
+ * Look up how the device at the location of dev was set up last time.
+ * On a hit, the entry is copied to dev->cached.
+ *
+ * @return 1 on a hit, 0 otherwise.
+ */
+static int mode_cache_lookup(struct usb_device *dev)
+{
+	int i;
+	if(!mode_cache_enabled || !dev->num_ports)
+		return 0;
+	for(i = 0; i < MODE_CACHE_SIZE; i++) {
+		if(mode_cache_match(&mode_cache[i], dev)) {
+			if(mode_cache[i].desired_mode != usb_desired_mode())
+				return 0;
+			mode_cache[i].last_used = mstime64();
+			dev->cached = mode_cache[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Remember the setup of a device that is serving mux traffic
+static void mode_cache_store(struct usb_device *dev)
+{
+	int i;
+	struct mode_cache_entry *entry = NULL;
+	if(!mode_cache_enabled || !dev->num_ports)
+		return;
+	for(i = 0; i < MODE_CACHE_SIZE; i++) {
+		if(mode_cache_match(&mode_cache[i], dev)) {
+			entry = &mode_cache[i];
+			break;
+		}
+		if(!entry || mode_cache[i].last_used < entry->last_used)
+			entry = &mode_cache[i];
+	}
+	memset(entry, 0, sizeof(*entry));
+	entry->vid = dev->devdesc.idVendor;
+	entry->pid = dev->devdesc.idProduct;
+	entry->bcd = dev->devdesc.bcdDevice;
+	entry->bus = dev->bus;
+	memcpy(entry->ports, dev->ports, dev->num_ports);
+	entry->num_ports = dev->num_ports;
+	strncpy(entry->serial, dev->serial, sizeof(entry->serial) - 1);
+	entry->desired_mode = usb_desired_mode();
+	entry->configuration = dev->configuration;
+	entry->interface = dev->interface;
+	entry->ep_in = dev->ep_in;
+	entry->ep_out = dev->ep_out;
+	entry->langid = dev->langid;
+	entry->last_used = mstime64();
+}
+
+static void mode_cache_drop(struct usb_device *dev)
+{
+	int i;
+	for(i = 0; i < MODE_CACHE_SIZE; i++) {
+		if(mode_cache_match(&mode_cache[i], dev))
+			mode_cache[i].last_used = 0;
+	}
+	dev->cache_hit = 0;
+}
+
+/**
+ * Use the cached interface and endpoints if the device is still in the
+ * cached configuration, instead of walking all its configurations.
+ *
+ * @return 1 if the cached setup applies, 0 otherwise.
+ */
+static int mode_cache_apply(struct usb_device *dev, struct libusb_device_handle *handle)
+{
+	int current_config = 0;
+	if(libusb_get_configuration(handle, &current_config) != 0 || current_config != dev->cached.configuration) {
+		dev->cache_hit = 0;
+		return 0;
+	}
+	dev->configuration = current_config;
+	dev->interface = dev->cached.interface;
+	dev->ep_in = dev->cached.ep_in;
+	dev->ep_out = dev->cached.ep_out;
+	usbmuxd_log(LL_INFO, "Using cached interface %i with endpoints %02x/%02x in configuration %d for device %i-%i", dev->interface, dev->ep_out, dev->ep_in, current_config, dev->bus, dev->address);
+	return 1;
+}
+
+static int usb_request_mode(struct usb_device *usbdev, struct libusb_device *dev);
+
 static void get_serial_callback(struct libusb_transfer *transfer)
 {
 	unsigned int di, si;
 	struct usb_device *usbdev = transfer->user_data;
+	if(usb_defer(transfer))
+		return;
 
 	if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		usbmuxd_log(LL_ERROR, "Failed to request serial for device %d-%d (%i)", usbdev->bus, usbdev->address, transfer->status);
@@ -341,25 +1133,46 @@ static void get_serial_callback(struct libusb_transfer *transfer)
 		usbdev->serial[di+1] = '\0';
 	}
 
+	// a different device of the same model took the cached location,
+	// so its mode has to be checked after all
+	if(usbdev->cache_hit && strcmp(usbdev->serial, usbdev->cached.serial) != 0) {
+		usbmuxd_log(LL_NOTICE, "Device %d-%d is not the cached one, requesting its mode", usbdev->bus, usbdev->address);
+		mode_cache_drop(usbdev);
+		libusb_release_interface(usbdev->handle, usbdev->interface);
+		if(usb_request_mode(usbdev, libusb_get_device(usbdev->handle)) != 0)
+			usbdev->alive = 0;
+		return;
+	}
+
+	if(use_usbfs)
+		usb_start_usbfs(usbdev);
+
 	/* Finish setup now */
 	if(device_add(usbdev) < 0) {
 		usb_disconnect(usbdev);
 		return;
 	}
 
-	// Spin up NUM_RX_LOOPS parallel usb data retrieval loops
+	mode_cache_store(usbdev);
+
+	// usbfs has its RX URBs running already
+	if(usbdev->usbfs)
+		return;
+
+	// Spin up rx_depth parallel usb data retrieval loops
 	// Old usbmuxds used only 1 rx loop, but that leaves the
 	// USB port sleeping most of the time
-	int rx_loops = NUM_RX_LOOPS;
-	for (rx_loops = NUM_RX_LOOPS; rx_loops > 0; rx_loops--) {
+	int num_loops = usbdev->rx_depth;
+	int rx_loops;
+	for (rx_loops = num_loops; rx_loops > 0; rx_loops--) {
 		if(start_rx_loop(usbdev) < 0) {
-			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
+			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", num_loops - rx_loops);
 			break;
 		}
 	}
 
 	// Ensure we have at least 1 RX loop going
-	if (rx_loops == NUM_RX_LOOPS) {
+	if (rx_loops == num_loops) {
 		usbmuxd_log(LL_FATAL, "Failed to start any RX loop for device %d-%d",
 					usbdev->bus, usbdev->address);
 		device_remove(usbdev);
@@ -368,16 +1181,29 @@ static void get_serial_callback(struct libusb_transfer *transfer)
 	} else if (rx_loops > 0) {
 		usbmuxd_log(LL_WARNING, "Failed to start all %d RX loops. Going on with %d loops. "
 					"This may have negative impact on device read speed.",
-					NUM_RX_LOOPS, NUM_RX_LOOPS - rx_loops);
+					num_loops, num_loops - rx_loops);
+		usbdev->rx_depth = num_loops - rx_loops;
+		usbdev->rx_depth_min = usbdev->rx_depth;
 	} else {
-		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", NUM_RX_LOOPS);
+		usbmuxd_log(LL_DEBUG, "All %d RX loops of %u bytes started successfully", num_loops, usbdev->rx_size);
 	}
 }
 
+static int usb_request_serial(struct usb_device *usbdev, struct libusb_transfer *transfer, unsigned char *buffer, uint16_t langid)
+{
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+			(uint16_t)((LIBUSB_DT_STRING << 8) | usbdev->devdesc.iSerialNumber),
+			langid, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
+	libusb_fill_control_transfer(transfer, usbdev->handle, buffer, get_serial_callback, usbdev, 1000);
+	return libusb_submit_transfer(transfer);
+}
+
 static void get_langid_callback(struct libusb_transfer *transfer)
 {
 	int res;
 	struct usb_device *usbdev = transfer->user_data;
+	if(usb_defer(transfer))
+		return;
 
 	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
 
@@ -391,14 +1217,10 @@ static void get_langid_callback(struct libusb_transfer *transfer)
 	unsigned char *data = libusb_control_transfer_get_data(transfer);
 	uint16_t langid = (uint16_t)(data[2] | (data[3] << 8));
 	usbmuxd_log(LL_INFO, "Got lang ID %u for device %d-%d", langid, usbdev->bus, usbdev->address);
+	usbdev->langid = langid;
 
 	/* re-use the same transfer */
-	libusb_fill_control_setup(transfer->buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
-			(uint16_t)((LIBUSB_DT_STRING << 8) | usbdev->devdesc.iSerialNumber),
-			langid, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
-	libusb_fill_control_transfer(transfer, usbdev->handle, transfer->buffer, get_serial_callback, usbdev, 1000);
-
-	if((res = libusb_submit_transfer(transfer)) < 0) {
+	if((res = usb_request_serial(usbdev, transfer, transfer->buffer, langid)) < 0) {
 		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
 		libusb_free_transfer(transfer);
 	}
@@ -412,10 +1234,14 @@ static int submit_vendor_specific(struct libusb_device_handle *handle, struct mo
 	uint8_t bRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_DEVICE;
 	libusb_fill_control_setup(buffer, bRequestType, context->bRequest, context->wValue, context->wIndex, context->wLength);
 	
-	ctrl_transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+	// freed by the callback, which may run after libusb is done with the
+	// transfer when it is deferred from a bus thread
+	ctrl_transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 	libusb_fill_control_transfer(ctrl_transfer, handle, buffer, callback, context, context->timeout);
 	
 	ret = libusb_submit_transfer(ctrl_transfer);
+	if(ret != 0)
+		libusb_free_transfer(ctrl_transfer);
 	return ret;
 }
 
@@ -587,6 +1413,7 @@ static int set_valid_configuration(struct libusb_device* dev, struct usb_device
 			}
 		}
 		
+		usbdev->configuration = config->bConfigurationValue;
 		libusb_free_config_descriptor(config);
 		break;
 	}
@@ -599,6 +1426,42 @@ static int set_valid_configuration(struct libusb_device* dev, struct usb_device
 	return 0;
 }
 
+/**
+ * Check whether the kernel hands bulk transfers larger than USB_MRU to
+ * the device in one piece instead of libusb splitting them up. On
+ * Linux this is the case when usbfs supports scatter-gather or has no
+ * packet size limit.
+ *
+ * @return 1 if large RX transfers are safe to use, 0 otherwise.
+ */
+static int usb_large_mru_supported(struct usb_device *dev)
+{
+#if defined(__linux__) && defined(USBDEVFS_GET_CAPABILITIES)
+	char path[32];
+	uint32_t caps = 0;
+	int fd, res;
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", dev->bus, dev->address);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		usbmuxd_log(LL_DEBUG, "Could not open %s to query usbfs capabilities", path);
+		return 0;
+	}
+	res = ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps);
+	close(fd);
+	if (res < 0)
+		return 0;
+#ifdef USBDEVFS_CAP_BULK_SCATTER_GATHER
+	if (caps & USBDEVFS_CAP_BULK_SCATTER_GATHER)
+		return 1;
+#endif
+#ifdef USBDEVFS_CAP_NO_PACKET_SIZE_LIM
+	if (caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)
+		return 1;
+#endif
+#endif
+	return 0;
+}
+
 static void device_complete_initialization(struct mode_context *context, struct libusb_device_handle *handle) 
 {
 	struct usb_device *usbdev = find_device(context->bus, context->address);
@@ -613,13 +1476,16 @@ static void device_complete_initialization(struct mode_context *context, struct
 	int res;
 	struct libusb_transfer *transfer;
 
-	if((res = set_valid_configuration(dev, usbdev, handle)) != 0) {
+	if(usbdev->cache_hit) {
+		// interface and endpoints are known, see mode_cache_apply()
+	} else if((res = set_valid_configuration(dev, usbdev, handle)) != 0) {
 		usbdev->alive = 0;
 		return;
 	}
 
 	if((res = libusb_claim_interface(handle, usbdev->interface)) != 0) {
 		usbmuxd_log(LL_WARNING, "Could not claim interface %d for device %d-%d: %s", usbdev->interface, bus, address, libusb_error_name(res));
+		mode_cache_drop(usbdev);
 		usbdev->alive = 0;
 		return;
 	}
@@ -676,19 +1542,64 @@ static void device_complete_initialization(struct mode_context *context, struct
 
 	usbmuxd_log(LL_INFO, "USB Speed is %g MBit/s for device %d-%d", (double)(usbdev->speed / 1000000.0), usbdev->bus, usbdev->address);
 
+	// RX depth and transfer size by link speed, unless overridden
+	if (usbdev->speed <= 12000000) {
+		usbdev->rx_depth = NUM_RX_LOOPS_FULL;
+		usbdev->rx_size = USB_MRU_FULL;
+	} else if (usbdev->speed <= 480000000) {
+		usbdev->rx_depth = NUM_RX_LOOPS;
+		usbdev->rx_size = USB_MRU;
+	} else if (usbdev->speed <= 5000000000) {
+		usbdev->rx_depth = NUM_RX_LOOPS_SUPER;
+		usbdev->rx_size = USB_MRU;
+	} else {
+		usbdev->rx_depth = NUM_RX_LOOPS_SUPER_PLUS;
+		usbdev->rx_size = USB_MRU;
+	}
+	if (rx_depth > 0)
+		usbdev->rx_depth = (rx_depth > NUM_RX_LOOPS_MAX) ? NUM_RX_LOOPS_MAX : rx_depth;
+	uint32_t max_size = USB_MRU;
+	if (rx_large) {
+		if (usb_large_mru_supported(usbdev)) {
+			usbmuxd_log(LL_INFO, "Using large RX transfers for device %d-%d", usbdev->bus, usbdev->address);
+			max_size = USB_MRU_LARGE;
+			usbdev->rx_size = USB_MRU_LARGE;
+		} else {
+			usbmuxd_log(LL_INFO, "Kernel does not support large RX transfers for device %d-%d", usbdev->bus, usbdev->address);
+		}
+	}
+	if (rx_size > 0) {
+		// whole packets only, within what the reassembly can handle
+		usbdev->rx_size = rx_size - rx_size % usbdev->wMaxPacketSize;
+		if (usbdev->rx_size < USB_MRU_MIN)
+			usbdev->rx_size = USB_MRU_MIN;
+		if (usbdev->rx_size > max_size)
+			usbdev->rx_size = max_size;
+	}
+	usbdev->rx_depth_min = usbdev->rx_depth;
+
 	/**
 	 * From libusb:
 	 * 	Asking for the zero'th index is special - it returns a string
 	 * 	descriptor that contains all the language IDs supported by the
 	 * 	device.
 	 **/
-	libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
-	libusb_fill_control_transfer(transfer, handle, transfer_buffer, get_langid_callback, usbdev, 1000);
+	if(usbdev->cache_hit) {
+		// the language ID of a known device is cached as well
+		usbdev->langid = usbdev->cached.langid;
+		transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+		res = usb_request_serial(usbdev, transfer, transfer_buffer, usbdev->langid);
+	} else {
+		libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
+		libusb_fill_control_transfer(transfer, handle, transfer_buffer, get_langid_callback, usbdev, 1000);
+		res = libusb_submit_transfer(transfer);
+	}
 
-	if((res = libusb_submit_transfer(transfer)) < 0) {
+	if(res < 0) {
 		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
+		if(!(transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+			free(transfer_buffer);
 		libusb_free_transfer(transfer);
-		free(transfer_buffer);
 		usbdev->alive = 0;
 		return;	
 	}
@@ -698,7 +1609,10 @@ static void switch_mode_cb(struct libusb_transfer* transfer)
 {
 	// For old devices not supporting mode swtich, if anything goes wrong - continue in current mode
 	struct mode_context* context = transfer->user_data;
-	struct usb_device *dev = find_device(context->bus, context->address);
+	struct usb_device *dev;
+	if(usb_defer(transfer))
+		return;
+	dev = find_device(context->bus, context->address);
 	if(!dev) {
 		usbmuxd_log(LL_WARNING, "Device %d-%d is missing from device list", context->bus, context->address);
 	}
@@ -716,8 +1630,7 @@ static void switch_mode_cb(struct libusb_transfer* transfer)
 		}
 	}
 	free(context);
-	if(transfer->buffer)
-		free(transfer->buffer);
+	libusb_free_transfer(transfer);
 }
 
 static void get_mode_cb(struct libusb_transfer* transfer) 
@@ -725,10 +1638,14 @@ static void get_mode_cb(struct libusb_transfer* transfer)
 	// For old devices not supporting mode swtich, if anything goes wrong - continue in current mode
 	int res;
 	struct mode_context* context = transfer->user_data;
-	struct usb_device *dev = find_device(context->bus, context->address);
+	struct usb_device *dev;
+	if(usb_defer(transfer))
+		return;
+	dev = find_device(context->bus, context->address);
 	if(!dev) {
 		usbmuxd_log(LL_ERROR, "Device %d-%d is missing from device list, aborting mode switch", context->bus, context->address);
 		free(context);
+		libusb_free_transfer(transfer);
 		return;
 	}
 
@@ -737,13 +1654,13 @@ static void get_mode_cb(struct libusb_transfer* transfer)
 			context->bus, context->address, transfer->status);
 		device_complete_initialization(context, transfer->dev_handle);
 		free(context);
+		libusb_free_transfer(transfer);
 		return;
 	}
 
 	unsigned char *data = libusb_control_transfer_get_data(transfer);
 
-	char* desired_mode_char = getenv(ENV_DEVICE_MODE);
-	int desired_mode = desired_mode_char ? atoi(desired_mode_char) : 1;
+	int desired_mode = usb_desired_mode();
 	int guessed_mode = guess_mode(context->dev, dev);
 
 	// Response is 3:3:3:0 for initial mode, 5:3:3:0 otherwise.
@@ -769,8 +1686,33 @@ static void get_mode_cb(struct libusb_transfer* transfer)
 		device_complete_initialization(context, transfer->dev_handle);
 		free(context);
 	}
-	if(transfer->buffer)
-		free(transfer->buffer);
+	libusb_free_transfer(transfer);
+}
+
+static int usb_request_mode(struct usb_device *usbdev, struct libusb_device *dev)
+{
+	// On top of configurations, Apple have multiple "modes" for devices, namely:
+	// 1: An "initial" mode with 4 configurations
+	// 2: "Valeria" mode, where configuration 5 is included with interface for H.265 video capture (activated when recording screen with QuickTime in macOS)
+	// 3: "CDC NCM" mode, where configuration 5 is included with interface for Ethernet/USB (activated using internet-sharing feature in macOS)
+	// Request current mode asynchroniously, so it can be changed in callback if needed
+	usbmuxd_log(LL_INFO, "Requesting current mode from device %i-%i", usbdev->bus, usbdev->address);
+	struct mode_context* context = malloc(sizeof(struct mode_context));
+	context->dev = dev;
+	context->bus = usbdev->bus;
+	context->address = usbdev->address;
+	context->bRequest = APPLE_VEND_SPECIFIC_GET_MODE;
+	context->wValue = 0;
+	context->wIndex = 0;
+	context->wLength = 4;
+	context->timeout = 1000;
+
+	if(submit_vendor_specific(usbdev->handle, context, get_mode_cb) != 0) {
+		usbmuxd_log(LL_WARNING, "Could not request current mode from device %d-%d", usbdev->bus, usbdev->address);
+		free(context);
+		return -1;
+	}
+	return 0;
 }
 
 static int usb_device_add(libusb_device* dev)
@@ -800,9 +1742,26 @@ static int usb_device_add(libusb_device* dev)
 		return -1;
 	libusb_device_handle *handle;
 	usbmuxd_log(LL_INFO, "Found new device with v/p %04x:%04x at %d-%d", devdesc.idVendor, devdesc.idProduct, bus, address);
+	// Open the device in the context of its bus if it has one, so that
+	// all its transfers are handled by the bus thread
+	struct usb_bus *worker = NULL;
+	if(usb_threads && (worker = usb_get_bus(bus))) {
+		libusb_device *busdev = usb_bus_find_device(worker, address);
+		if(busdev) {
+			dev = busdev;
+		} else {
+			usbmuxd_log(LL_WARNING, "Device %d-%d not found in context of its bus, using main context", bus, address);
+			worker = NULL;
+		}
+	}
 	// No blocking operation can follow: it may be run in the libusb hotplug callback and libusb will refuse any
 	// blocking call
-	if((res = libusb_open(dev, &handle)) != 0) {
+	res = libusb_open(dev, &handle);
+	if(worker) {
+		// the handle keeps its own reference
+		libusb_unref_device(dev);
+	}
+	if(res != 0) {
 		usbmuxd_log(LL_WARNING, "Could not open device %d-%d: %s", bus, address, libusb_error_name(res));
 		return -1;
 	}
@@ -817,31 +1776,42 @@ static int usb_device_add(libusb_device* dev)
 	usbdev->devdesc = devdesc;
 	usbdev->speed = 0;
 	usbdev->handle = handle;
+	usbdev->worker = worker;
 	usbdev->alive = 1;
+	usbdev->refs = 1;
 
 	collection_init(&usbdev->tx_xfers);
 	collection_init(&usbdev->rx_xfers);
+	collection_init(&usbdev->tx_parked);
+	tx_recovery_init(&usbdev->tx, bus, address, tx_timeout, tx_watchdog);
+
+#ifdef HAVE_LIBUSB_PORT_NUMBERS
+	res = libusb_get_port_numbers(dev, usbdev->ports, USB_MAX_PORTS);
+	usbdev->num_ports = (res > 0) ? res : 0;
+#endif
 
 	collection_add(&device_list, usbdev);
 
-	// On top of configurations, Apple have multiple "modes" for devices, namely:
-	// 1: An "initial" mode with 4 configurations
-	// 2: "Valeria" mode, where configuration 5 is included with interface for H.265 video capture (activated when recording screen with QuickTime in macOS)
-	// 3: "CDC NCM" mode, where configuration 5 is included with interface for Ethernet/USB (activated using internet-sharing feature in macOS)
-	// Request current mode asynchroniously, so it can be changed in callback if needed
-	usbmuxd_log(LL_INFO, "Requesting current mode from device %i-%i", bus, address);
-	struct mode_context* context = malloc(sizeof(struct mode_context));
-	context->dev = dev;
-	context->bus = bus;
-	context->address = address;
-	context->bRequest = APPLE_VEND_SPECIFIC_GET_MODE;
-	context->wValue = 0;
-	context->wIndex = 0;
-	context->wLength = 4;
-	context->timeout = 1000;
+	// A device seen at this location before was set up without a mode
+	// switch; if it is still in the same configuration, skip straight
+	// to claiming its interface. Otherwise it may have come back in
+	// another mode (e.g. after a reboot) and needs to be checked again.
+	if(mode_cache_lookup(usbdev)) {
+		usbdev->cache_hit = 1;
+		if(mode_cache_apply(usbdev, handle)) {
+			struct mode_context context;
+			usbmuxd_log(LL_INFO, "Found device %i-%i in mode cache, skipping mode request", bus, address);
+			context.dev = dev;
+			context.bus = bus;
+			context.address = address;
+			device_complete_initialization(&context, handle);
+			return 0;
+		}
+		usbmuxd_log(LL_INFO, "Device %i-%i is not in its cached configuration anymore", bus, address);
+		mode_cache_drop(usbdev);
+	}
 
-	if(submit_vendor_specific(handle, context, get_mode_cb) != 0) {
-		usbmuxd_log(LL_WARNING, "Could not request current mode from device %d-%d", bus, address);
+	if(usb_request_mode(usbdev, dev) != 0) {
 		// Schedule device for close and cleanup
 		usbdev->alive = 0;
 		return -1;
@@ -928,6 +1898,31 @@ uint16_t usb_get_pid(struct usb_device *dev)
 	return dev->devdesc.idProduct;
 }
 
+uint32_t usb_get_mru(struct usb_device *dev)
+{
+	return dev->rx_size;
+}
+
+int usb_get_rx_depth(struct usb_device *dev)
+{
+	return dev->rx_depth;
+}
+
+const struct usb_rx_stats *usb_get_rx_stats(struct usb_device *dev)
+{
+	return &dev->rx_stats;
+}
+
+const struct usb_tx_stats *usb_get_tx_stats(struct usb_device *dev)
+{
+	return &dev->tx.stats;
+}
+
+const char *usb_get_backend(struct usb_device *dev)
+{
+	return dev->usbfs ? "usbfs" : "libusb";
+}
+
 uint64_t usb_get_speed(struct usb_device *dev)
 {
 	if (!dev->handle) {
@@ -951,6 +1946,13 @@ void usb_get_fds(struct fdlist *list)
 		p++;
 	}
 	free(usbfds);
+	if(usb_wake_fd[0] >= 0)
+		fdlist_add(list, FD_USB, usb_wake_fd[0], POLLIN);
+	// usbfs signals reapable URBs as writable
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->usbfs)
+			fdlist_add(list, FD_USB, usbfs_get_fd(usbdev->usbfs), POLLOUT);
+	} ENDFOREACH
 }
 
 void usb_autodiscover(int enable)
@@ -981,6 +1983,17 @@ int usb_get_timeout(void)
 	int res;
 	int pollrem;
 	pollrem = dev_poll_remain_ms();
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		int ms;
+		if(!usbdev->alive)
+			continue;
+		if(usbdev->usbfs)
+			ms = usbfs_get_timeout(usbdev->usbfs);
+		else
+			ms = tx_recovery_get_timeout(&usbdev->tx, collection_count(&usbdev->tx_xfers) > 0, 0);
+		if(ms >= 0 && ms < pollrem)
+			pollrem = ms;
+	} ENDFOREACH
 	res = libusb_get_next_timeout(NULL, &tv);
 	if(res == 0)
 		return pollrem;
@@ -1006,9 +2019,20 @@ int usb_process(void)
 		return res;
 	}
 
+	usb_drain_completions();
+
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->alive && usbdev->usbfs && usbfs_process(usbdev->usbfs) < 0) {
+			usbmuxd_log(LL_INFO, "usbfs data path of device %d-%d failed", usbdev->bus, usbdev->address);
+			usbdev->alive = 0;
+		}
+	} ENDFOREACH
+
 	// reap devices marked dead due to an RX error
 	reap_dead_devices();
 
+	usb_check_tx();
+
 	if(dev_poll_remain_ms() <= 0) {
 		res = usb_discover();
 		if(res < 0) {
@@ -1040,6 +2064,7 @@ int usb_process_timeout(int msec)
 			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout failed: %s", libusb_error_name(res));
 			return res;
 		}
+		usb_drain_completions();
 		// reap devices marked dead due to an RX error
 		reap_dead_devices();
 		get_tick_count(&tcur);
@@ -1081,6 +2106,15 @@ int usb_init(void)
 
 	devlist_failures = 0;
 	device_polling = 1;
+	tx_timeout = getenv_uint(ENV_TX_TIMEOUT, 0);
+	tx_watchdog = getenv_uint(ENV_TX_WATCHDOG, 0);
+	rx_depth = getenv_int(ENV_RX_DEPTH, 0);
+	rx_size = getenv_int(ENV_RX_SIZE, 0);
+	rx_adapt = getenv_int(ENV_RX_ADAPT, 0);
+	rx_large = getenv_int(ENV_RX_LARGE, 0);
+	use_usbfs = getenv_int(ENV_USBFS, 0);
+	usb_threads = getenv_int(ENV_USB_THREADS, 0);
+	mode_cache_enabled = getenv_int(ENV_MODE_CACHE, 0);
 	res = libusb_init(NULL);
 
 	if (res != 0) {
@@ -1095,6 +2129,19 @@ int usb_init(void)
 #endif
 
 	collection_init(&device_list);
+	collection_init(&bus_list);
+
+	if (usb_threads) {
+		if (pipe(usb_wake_fd) < 0) {
+			usbmuxd_log(LL_ERROR, "Could not create wakeup pipe, not using per-bus USB threads");
+			usb_wake_fd[0] = usb_wake_fd[1] = -1;
+			usb_threads = 0;
+		} else {
+			fcntl(usb_wake_fd[0], F_SETFL, O_NONBLOCK);
+			fcntl(usb_wake_fd[1], F_SETFL, O_NONBLOCK);
+			usbmuxd_log(LL_INFO, "Using one USB thread per bus");
+		}
+	}
 
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
@@ -1132,5 +2179,14 @@ void usb_shutdown(void)
 		usb_disconnect(usbdev);
 	} ENDFOREACH
 	collection_free(&device_list);
+	FOREACH(struct usb_bus *bus, &bus_list) {
+		usb_stop_bus(bus);
+	} ENDFOREACH
+	collection_free(&bus_list);
+	if (usb_wake_fd[0] >= 0) {
+		close(usb_wake_fd[0]);
+		close(usb_wake_fd[1]);
+		usb_wake_fd[0] = usb_wake_fd[1] = -1;
+	}
 	libusb_exit(NULL);
 }
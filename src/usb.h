@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include "utils.h"
+#include "txrecover.h"
 
 #define INTERFACE_CLASS 255
 #define INTERFACE_SUBCLASS 254
@@ -32,6 +33,11 @@
 // libusb fragments packets larger than this (usbfs limitation)
 // on input, this creates race conditions and other issues
 #define USB_MRU 16384
+// smallest RX transfer size used for any device
+#define USB_MRU_MIN 4096
+// RX transfer size when the kernel takes large bulk transfers in one
+// piece (see ENV_RX_LARGE); a whole mux packet fits into one transfer
+#define USB_MRU_LARGE 65536
 
 // max transmission packet size
 // libusb fragments these too, but doesn't send ZLPs so we're safe
@@ -54,14 +60,50 @@
 #define APPLE_VEND_SPECIFIC_GET_MODE 0x45
 #define APPLE_VEND_SPECIFIC_SET_MODE 0x52
 
+// timeout for a single TX transfer, and the time without any TX
+// completion after which a device's OUT pipe is considered stuck (ms)
+#define ENV_TX_TIMEOUT "USBMUXD_TX_TIMEOUT"
+#define ENV_TX_WATCHDOG "USBMUXD_TX_WATCHDOG"
+
+// number and size of RX transfers per device, and whether to adapt
+// the number to the observed load
+#define ENV_RX_DEPTH "USBMUXD_RX_DEPTH"
+#define ENV_RX_SIZE "USBMUXD_RX_SIZE"
+#define ENV_RX_ADAPT "USBMUXD_RX_ADAPT"
+#define ENV_RX_LARGE "USBMUXD_RX_LARGE"
+
+// move bulk data of set up devices from libusb to usbfs (Linux only)
+#define ENV_USBFS "USBMUXD_USBFS"
+
+// one libusb context and event thread per USB bus
+#define ENV_USB_THREADS "USBMUXD_USB_THREADS"
+
+// remember mode and configuration of devices for a fast replug
+#define ENV_MODE_CACHE "USBMUXD_MODE_CACHE"
+
+// RX pipe utilisation of a device: completions that found no other RX
+// transfer in flight, and time spent processing received data (us)
+struct usb_rx_stats {
+	uint64_t completions;
+	uint64_t pipe_empty;
+	uint64_t process_time;
+};
+
 struct usb_device;
 
 int usb_init(void);
 void usb_shutdown(void);
+void usb_device_ref(struct usb_device *dev);
+void usb_device_unref(struct usb_device *dev);
 const char *usb_get_serial(struct usb_device *dev);
 uint32_t usb_get_location(struct usb_device *dev);
 uint16_t usb_get_pid(struct usb_device *dev);
 uint64_t usb_get_speed(struct usb_device *dev);
+uint32_t usb_get_mru(struct usb_device *dev);
+int usb_get_rx_depth(struct usb_device *dev);
+const struct usb_rx_stats *usb_get_rx_stats(struct usb_device *dev);
+const struct usb_tx_stats *usb_get_tx_stats(struct usb_device *dev);
+const char *usb_get_backend(struct usb_device *dev);
 void usb_get_fds(struct fdlist *list);
 int usb_get_timeout(void);
 int usb_send(struct usb_device *dev, const unsigned char *buf, int length);
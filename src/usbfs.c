@@ -0,0 +1,458 @@
+/*
+ * usbfs.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "usbfs.h"
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include <libimobiledevice-glue/collection.h>
+
+#include "device.h"
+#include "bufpool.h"
+#include "log.h"
+#include "utils.h"
+
+// TX URBs allocated up front, more are added when all are in flight
+#define USBFS_TX_URBS 32
+
+struct usbfs_urb {
+	struct usbdevfs_urb urb;
+	struct usbfs_urb *next;	// free list
+	int rx;
+	int busy;
+	int discarded;	// discarded, waiting to be reaped
+	int parked;	// waiting to be resubmitted after a recovery
+	uint32_t length;
+	uint64_t seq;	// submission order, for resubmitting after a recovery
+	uint64_t submit_time;
+};
+
+struct usbfs_pipe {
+	int fd;
+	struct usb_device *owner;
+	unsigned int interface;
+	uint8_t ep_in, ep_out;
+	int max_packet_size;
+	uint32_t rx_size;
+	int rx_depth;
+	int rx_pending;
+	struct usbfs_urb *rx_urbs;
+	struct collection tx_urbs;	// all TX URBs, busy or not
+	struct usbfs_urb *tx_free;
+	uint64_t tx_next_seq;
+	struct tx_recovery *tx;	// owned by the usb_device
+	struct usb_rx_stats *rx_stats;
+};
+
+static int usbfs_submit(struct usbfs_pipe *pipe, struct usbfs_urb *u)
+{
+	u->submit_time = ustime64();
+	if(ioctl(pipe->fd, USBDEVFS_SUBMITURB, &u->urb) < 0)
+		return -errno;
+	u->busy = 1;
+	u->discarded = 0;
+	return 0;
+}
+
+static int usbfs_submit_rx(struct usbfs_pipe *pipe, struct usbfs_urb *u)
+{
+	memset(&u->urb, 0, sizeof(u->urb));
+	u->urb.type = USBDEVFS_URB_TYPE_BULK;
+	u->urb.endpoint = pipe->ep_in;
+	u->urb.buffer = bufpool_get(pipe->rx_size);
+	if(!u->urb.buffer)
+		return -ENOMEM;
+	u->urb.buffer_length = pipe->rx_size;
+	u->urb.usercontext = u;
+	u->rx = 1;
+	return usbfs_submit(pipe, u);
+}
+
+/**
+ * Take over the mux interface of a device that libusb has set up and
+ * start reading from it. The interface must not be claimed by libusb
+ * anymore. Stuck TX URBs are recovered as for libusb, using the
+ * timeout, watchdog and statistics of tx (see usbfs_tx_park()).
+ *
+ * @return The pipe, or NULL if usbfs could not be used for the device.
+ */
+struct usbfs_pipe *usbfs_open(struct usb_device *owner, uint8_t bus, uint8_t address, int interface, uint8_t ep_in, uint8_t ep_out, int max_packet_size, int rx_depth, uint32_t rx_size, struct usb_rx_stats *rx_stats, struct tx_recovery *tx)
+{
+	char path[32];
+	int i, res;
+	unsigned int ifnum = interface;
+	struct usbfs_pipe *pipe;
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", bus, address);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd < 0) {
+		usbmuxd_log(LL_WARNING, "Could not open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if(ioctl(fd, USBDEVFS_CLAIMINTERFACE, &ifnum) < 0) {
+		usbmuxd_log(LL_WARNING, "Could not claim interface %d of %s: %s", interface, path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	pipe = calloc(1, sizeof(struct usbfs_pipe));
+	pipe->fd = fd;
+	pipe->owner = owner;
+	pipe->interface = ifnum;
+	pipe->ep_in = ep_in;
+	pipe->ep_out = ep_out;
+	pipe->max_packet_size = max_packet_size;
+	pipe->rx_size = rx_size;
+	pipe->rx_depth = rx_depth;
+	pipe->tx = tx;
+	pipe->rx_stats = rx_stats;
+	collection_init(&pipe->tx_urbs);
+	for(i = 0; i < USBFS_TX_URBS; i++) {
+		struct usbfs_urb *u = calloc(1, sizeof(struct usbfs_urb));
+		u->next = pipe->tx_free;
+		pipe->tx_free = u;
+		collection_add(&pipe->tx_urbs, u);
+	}
+
+	pipe->rx_urbs = calloc(rx_depth, sizeof(struct usbfs_urb));
+	for(i = 0; i < rx_depth; i++) {
+		if((res = usbfs_submit_rx(pipe, &pipe->rx_urbs[i])) < 0) {
+			usbmuxd_log(LL_WARNING, "Failed to submit RX URB %d to %s: %s", i, path, strerror(-res));
+			bufpool_put(pipe->rx_urbs[i].urb.buffer);
+			pipe->rx_urbs[i].urb.buffer = NULL;
+			break;
+		}
+		pipe->rx_pending++;
+	}
+	if(!pipe->rx_pending) {
+		usbfs_close(pipe);
+		return NULL;
+	}
+	usbmuxd_log(LL_INFO, "Using usbfs data path with %d RX URBs of %u bytes for device %d-%d", pipe->rx_pending, rx_size, bus, address);
+	return pipe;
+}
+
+/**
+ * Stop all I/O and give the interface back. Outstanding URBs are
+ * killed by the kernel when the file is closed.
+ */
+void usbfs_close(struct usbfs_pipe *pipe)
+{
+	int i;
+	if(!pipe)
+		return;
+	ioctl(pipe->fd, USBDEVFS_RELEASEINTERFACE, &pipe->interface);
+	close(pipe->fd);
+	for(i = 0; i < pipe->rx_depth; i++)
+		bufpool_put(pipe->rx_urbs[i].urb.buffer);
+	free(pipe->rx_urbs);
+	FOREACH(struct usbfs_urb *u, &pipe->tx_urbs) {
+		if(u->busy || u->parked)
+			free(u->urb.buffer);
+		free(u);
+	} ENDFOREACH
+	collection_free(&pipe->tx_urbs);
+	free(pipe);
+}
+
+int usbfs_get_fd(struct usbfs_pipe *pipe)
+{
+	return pipe->fd;
+}
+
+static int usbfs_tx_busy(struct usbfs_pipe *pipe)
+{
+	FOREACH(struct usbfs_urb *u, &pipe->tx_urbs) {
+		if(u->busy)
+			return 1;
+	} ENDFOREACH
+	return 0;
+}
+
+/**
+ * Queue a bulk OUT transfer. The ZLP for transfers that end on a
+ * packet boundary is sent by the kernel.
+ *
+ * @param buf Data to send; owned by the pipe on success.
+ * @return 0 on success, a negative errno value otherwise.
+ */
+int usbfs_send(struct usbfs_pipe *pipe, unsigned char *buf, int length)
+{
+	int res;
+	struct usbfs_urb *u = pipe->tx_free;
+	if(u) {
+		pipe->tx_free = u->next;
+	} else {
+		u = calloc(1, sizeof(struct usbfs_urb));
+		collection_add(&pipe->tx_urbs, u);
+	}
+	memset(&u->urb, 0, sizeof(u->urb));
+	u->urb.type = USBDEVFS_URB_TYPE_BULK;
+	u->urb.endpoint = pipe->ep_out;
+	u->urb.buffer = buf;
+	u->urb.buffer_length = length;
+	u->urb.usercontext = u;
+	if(length % pipe->max_packet_size == 0)
+		u->urb.flags = USBDEVFS_URB_ZERO_PACKET;
+	u->rx = 0;
+	u->length = length;
+	u->seq = pipe->tx_next_seq++;
+	if(pipe->tx->recovering) {
+		// keep the order, this goes out after the parked ones
+		u->parked = 1;
+		return 0;
+	}
+	if(!usbfs_tx_busy(pipe))
+		tx_recovery_busy(pipe->tx);
+	if((res = usbfs_submit(pipe, u)) < 0) {
+		u->next = pipe->tx_free;
+		pipe->tx_free = u;
+		return res;
+	}
+	return 0;
+}
+
+static int usbfs_rx_complete(struct usbfs_pipe *pipe, struct usbfs_urb *u)
+{
+	int res;
+	unsigned char *buf = u->urb.buffer;
+	uint32_t length = u->urb.actual_length;
+	uint64_t start;
+
+	u->busy = 0;
+	if(u->urb.status != 0) {
+		usbmuxd_log(LL_INFO, "RX URB failed: %s", strerror(-u->urb.status));
+		bufpool_put(buf);
+		u->urb.buffer = NULL;
+		pipe->rx_pending--;
+		return -1;
+	}
+
+	pipe->rx_stats->completions++;
+	if(pipe->rx_pending <= 1)
+		pipe->rx_stats->pipe_empty++;
+	// resubmit with a fresh buffer before processing, as in rx_callback()
+	if((res = usbfs_submit_rx(pipe, u)) < 0) {
+		usbmuxd_log(LL_ERROR, "Failed to resubmit RX URB: %s", strerror(-res));
+		bufpool_put(u->urb.buffer);
+		u->urb.buffer = NULL;
+		pipe->rx_pending--;
+	}
+	start = ustime64();
+	device_data_input(pipe->owner, buf, length);
+	pipe->rx_stats->process_time += ustime64() - start;
+	bufpool_put(buf);
+	return pipe->rx_pending ? 0 : -1;
+}
+
+/**
+ * Stop the OUT pipe for a recovery: discard everything in flight so
+ * that nothing overtakes the parked URBs. usbfs_tx_recover() resubmits
+ * them once all discarded URBs were reaped.
+ */
+static void usbfs_tx_stop(struct usbfs_pipe *pipe)
+{
+	FOREACH(struct usbfs_urb *u, &pipe->tx_urbs) {
+		if(!u->busy || u->discarded)
+			continue;
+		if(ioctl(pipe->fd, USBDEVFS_DISCARDURB, &u->urb) == 0)
+			u->discarded = 1;
+	} ENDFOREACH
+}
+
+/**
+ * Hold back a TX URB that failed or was discarded, so it can be
+ * resubmitted once the OUT pipe was recovered. Whatever the device
+ * already received is cut off the front.
+ */
+static void usbfs_tx_park(struct usbfs_pipe *pipe, struct usbfs_urb *u)
+{
+	u->urb.buffer_length = tx_recovery_trim(u->urb.buffer, u->urb.buffer_length, u->urb.actual_length);
+	u->parked = 1;
+	if(tx_recovery_stop(pipe->tx))
+		usbfs_tx_stop(pipe);
+}
+
+static int usbfs_tx_complete(struct usbfs_pipe *pipe, struct usbfs_urb *u)
+{
+	int status = u->urb.status;
+	int res = 0;
+	u->busy = 0;
+	if(status == -ENODEV || status == -ESHUTDOWN) {
+		usbmuxd_log(LL_INFO, "TX URB aborted due to disconnect");
+		res = -1;
+	} else if(status != 0 && u->urb.actual_length < u->urb.buffer_length) {
+		if(status == -EPIPE)
+			tx_recovery_failed(pipe->tx, 1);
+		else if(!u->discarded)
+			usbmuxd_log(LL_WARNING, "TX URB failed: %s, recovering", strerror(-status));
+		usbfs_tx_park(pipe, u);
+		return 0;
+	} else {
+		// done, possibly just before it failed or was discarded
+		tx_recovery_done(pipe->tx, u->length, ustime64() - u->submit_time);
+	}
+	device_tx_complete(pipe->owner, u->length, ustime64() - u->submit_time);
+	free(u->urb.buffer);
+	u->urb.buffer = NULL;
+	u->next = pipe->tx_free;
+	pipe->tx_free = u;
+	return res;
+}
+
+// Submission time of the oldest TX URB in flight, 0 if none
+static uint64_t usbfs_tx_oldest(struct usbfs_pipe *pipe)
+{
+	uint64_t oldest = 0;
+	FOREACH(struct usbfs_urb *u, &pipe->tx_urbs) {
+		if(u->busy && (!oldest || u->submit_time < oldest))
+			oldest = u->submit_time;
+	} ENDFOREACH
+	return oldest;
+}
+
+/**
+ * Discard the TX URBs if none completed for the watchdog period or one
+ * is in flight for longer than the TX timeout; they are reaped with an
+ * error status and parked afterwards.
+ */
+static void usbfs_check_tx(struct usbfs_pipe *pipe)
+{
+	uint64_t oldest = usbfs_tx_oldest(pipe);
+	if(tx_recovery_check(pipe->tx, oldest != 0, oldest))
+		usbfs_tx_stop(pipe);
+}
+
+/**
+ * Get the OUT pipe going again once all discarded TX URBs were reaped:
+ * clear the endpoint halt and resubmit the parked URBs in their
+ * original order.
+ *
+ * @return 0 on success or while still waiting, -1 if the device is to
+ *   be given up.
+ */
+static int usbfs_tx_recover(struct usbfs_pipe *pipe)
+{
+	int res;
+	unsigned int ep = pipe->ep_out;
+	if(!pipe->tx->recovering || usbfs_tx_busy(pipe))
+		return 0;
+	if(tx_recovery_begin(pipe->tx) < 0)
+		return -1;
+	if(ioctl(pipe->fd, USBDEVFS_CLEAR_HALT, &ep) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not clear halt on TX endpoint: %s", strerror(errno));
+		tx_recovery_end(pipe->tx, -1);
+		return -1;
+	}
+	while(1) {
+		struct usbfs_urb *next = NULL;
+		FOREACH(struct usbfs_urb *u, &pipe->tx_urbs) {
+			if(u->parked && (!next || u->seq < next->seq))
+				next = u;
+		} ENDFOREACH
+		if(!next)
+			break;
+		if((res = usbfs_submit(pipe, next)) < 0) {
+			usbmuxd_log(LL_ERROR, "Failed to resubmit TX URB: %s", strerror(-res));
+			tx_recovery_end(pipe->tx, res);
+			return -1;
+		}
+		next->parked = 0;
+	}
+	tx_recovery_end(pipe->tx, 0);
+	return 0;
+}
+
+/**
+ * @return Milliseconds until the next TX URB times out or the watchdog
+ *   fires, or -1 if no TX URB is in flight.
+ */
+int usbfs_get_timeout(struct usbfs_pipe *pipe)
+{
+	uint64_t oldest = usbfs_tx_oldest(pipe);
+	return tx_recovery_get_timeout(pipe->tx, oldest != 0, oldest);
+}
+
+/**
+ * Reap all completed URBs without blocking.
+ *
+ * @return 0 on success, -1 if the device is gone or failed.
+ */
+int usbfs_process(struct usbfs_pipe *pipe)
+{
+	int res = 0;
+	struct usbdevfs_urb *urb;
+	while(ioctl(pipe->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+		struct usbfs_urb *u = urb->usercontext;
+		if((u->rx ? usbfs_rx_complete(pipe, u) : usbfs_tx_complete(pipe, u)) < 0)
+			res = -1;
+	}
+	if(errno != EAGAIN)
+		res = -1;
+	usbfs_check_tx(pipe);
+	if(usbfs_tx_recover(pipe) < 0)
+		res = -1;
+	return res;
+}
+
+#else
+
+struct usbfs_pipe *usbfs_open(struct usb_device *owner, uint8_t bus, uint8_t address, int interface, uint8_t ep_in, uint8_t ep_out, int max_packet_size, int rx_depth, uint32_t rx_size, struct usb_rx_stats *rx_stats, struct tx_recovery *tx)
+{
+	return NULL;
+}
+
+void usbfs_close(struct usbfs_pipe *pipe)
+{
+}
+
+int usbfs_get_fd(struct usbfs_pipe *pipe)
+{
+	return -1;
+}
+
+int usbfs_send(struct usbfs_pipe *pipe, unsigned char *buf, int length)
+{
+	return -ENOSYS;
+}
+
+int usbfs_process(struct usbfs_pipe *pipe)
+{
+	return -1;
+}
+
+int usbfs_get_timeout(struct usbfs_pipe *pipe)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * usbfs.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef USBFS_H
+#define USBFS_H
+
+#include <stdint.h>
+#include "usb.h"
+
+// Bulk data path that talks to Linux usbfs directly. Discovery,
+// configuration and control requests stay with libusb; once a device is
+// set up, its mux interface is handed over to a usbfs_pipe.
+struct usbfs_pipe;
+
+struct usbfs_pipe *usbfs_open(struct usb_device *owner, uint8_t bus, uint8_t address, int interface, uint8_t ep_in, uint8_t ep_out, int max_packet_size, int rx_depth, uint32_t rx_size, struct usb_rx_stats *rx_stats, struct tx_recovery *tx);
+void usbfs_close(struct usbfs_pipe *pipe);
+int usbfs_get_fd(struct usbfs_pipe *pipe);
+int usbfs_send(struct usbfs_pipe *pipe, unsigned char *buf, int length);
+int usbfs_process(struct usbfs_pipe *pipe);
+int usbfs_get_timeout(struct usbfs_pipe *pipe);
+
+#endif
@@ -76,6 +76,105 @@ void fdlist_reset(struct fdlist *list)
 	list->count = 0;
 }
 
+/**
+ * Parse a comma separated list of PORT:VALUE pairs, for example
+ * "62078:0,1234:2". Malformed entries are skipped with a warning.
+ */
+void port_map_parse(struct port_map *map, const char *spec)
+{
+	map->count = 0;
+	map->entries = NULL;
+	if (!spec || !*spec)
+		return;
+
+	const char *p = spec;
+	while (*p) {
+		char *endp = NULL;
+		long port = strtol(p, &endp, 10);
+		long value = 0;
+		if (endp != p && *endp == ':') {
+			const char *v = endp + 1;
+			value = strtol(v, &endp, 10);
+			if (endp != v && (*endp == ',' || *endp == '\0') && port > 0 && port <= 65535) {
+				map->entries = realloc(map->entries, sizeof(struct port_map_entry) * (map->count + 1));
+				map->entries[map->count].port = (uint16_t)port;
+				map->entries[map->count].value = (int)value;
+				map->count++;
+			} else {
+				endp = NULL;
+			}
+		} else {
+			endp = NULL;
+		}
+		if (!endp) {
+			util_error("Ignoring malformed port map entry in '%s'", spec);
+			endp = strchr(p, ',');
+			if (!endp)
+				break;
+		}
+		p = (*endp == ',') ? endp + 1 : endp;
+	}
+}
+
+int port_map_get(struct port_map *map, uint16_t port, int defval)
+{
+	int i;
+	for (i = 0; i < map->count; i++) {
+		if (map->entries[i].port == port)
+			return map->entries[i].value;
+	}
+	return defval;
+}
+
+void port_map_free(struct port_map *map)
+{
+	free(map->entries);
+	map->entries = NULL;
+	map->count = 0;
+}
+
+/**
+ * Read an integer tunable from the environment.
+ *
+ * @return The value of the environment variable, or defval if it
+ *   is not set or cannot be parsed.
+ */
+int getenv_int(const char *name, int defval)
+{
+	const char *str = getenv(name);
+	char *endp = NULL;
+	long val;
+	if (!str || !*str)
+		return defval;
+	val = strtol(str, &endp, 10);
+	if (*endp != '\0') {
+		util_error("Ignoring invalid value '%s' for %s", str, name);
+		return defval;
+	}
+	return (int)val;
+}
+
+/**
+ * Read a non-negative integer tunable from the environment.
+ *
+ * @return The value of the environment variable, or defval if it
+ *   is not set, cannot be parsed or is negative.
+ */
+unsigned int getenv_uint(const char *name, unsigned int defval)
+{
+	const char *str = getenv(name);
+	char *endp = NULL;
+	long val;
+	if (!str || !*str)
+		return defval;
+	val = strtol(str, &endp, 10);
+	if (*endp != '\0' || val < 0) {
+		util_error("Ignoring invalid value '%s' for %s", str, name);
+		return defval;
+	}
+	return (unsigned int)val;
+}
+
 #ifndef HAVE_CLOCK_GETTIME
 typedef int clockid_t;
 #define CLOCK_MONOTONIC 1
@@ -129,3 +228,14 @@ uint64_t mstime64(void)
 	// time_t could be 4 bytes
 	return ((long long)tv.tv_sec) * 1000LL + ((long long)tv.tv_usec) / 1000LL;
 }
+
+/**
+ * Get number of microseconds from the monotonic clock.
+ */
+uint64_t ustime64(void)
+{
+	struct timeval tv;
+	get_tick_count(&tv);
+
+	return ((long long)tv.tv_sec) * 1000000LL + (long long)tv.tv_usec;
+}
@@ -43,7 +43,25 @@ void fdlist_add(struct fdlist *list, enum fdowner owner, int fd, short events);
 void fdlist_free(struct fdlist *list);
 void fdlist_reset(struct fdlist *list);
 
+struct port_map_entry {
+	uint16_t port;
+	int value;
+};
+
+struct port_map {
+	int count;
+	struct port_map_entry *entries;
+};
+
+void port_map_parse(struct port_map *map, const char *spec);
+int port_map_get(struct port_map *map, uint16_t port, int defval);
+void port_map_free(struct port_map *map);
+
+int getenv_int(const char *name, int defval);
+unsigned int getenv_uint(const char *name, unsigned int defval);
+
 uint64_t mstime64(void);
+uint64_t ustime64(void);
 void get_tick_count(struct timeval * tv);
 
 #endif
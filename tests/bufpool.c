@@ -0,0 +1,93 @@
+/*
+ * bufpool.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+
+static void test_size_classes(void)
+{
+	unsigned char *a, *b;
+	// sizes within one class share the free list
+	a = bufpool_get(4096);
+	CHECK(a != NULL);
+	CHECK(((uintptr_t)a & 63) == 0);
+	bufpool_put(a);
+	b = bufpool_get(100);
+	CHECK(b == a);
+	bufpool_put(b);
+
+	// a larger size does not get the small buffer
+	b = bufpool_get(4097);
+	CHECK(b != NULL && b != a);
+	memset(b, 0xaa, 8192);
+	bufpool_put(b);
+	a = bufpool_get(8192);
+	CHECK(a == b);
+	bufpool_put(a);
+
+	a = bufpool_get(65536);
+	CHECK(a != NULL);
+	memset(a, 0x55, 65536);
+	bufpool_put(a);
+	CHECK(bufpool_get(65537) == NULL);
+}
+
+static void test_refcount(void)
+{
+	unsigned char *a, *b;
+	a = bufpool_get(16384);
+	bufpool_ref(a);
+	bufpool_put(a);
+	// still referenced, not back in the pool
+	b = bufpool_get(16384);
+	CHECK(b != a);
+	bufpool_put(a);
+	bufpool_put(b);
+	// the most recently returned buffer comes back first
+	CHECK(bufpool_get(16384) == b);
+	CHECK(bufpool_get(16384) == a);
+	bufpool_put(a);
+	bufpool_put(b);
+	bufpool_put(NULL);
+}
+
+int main(void)
+{
+	bufpool_init();
+	test_size_classes();
+	test_refcount();
+	bufpool_shutdown();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * drr.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "drr.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+
+#define UNIT 49152
+#define SEGMENT 16000
+
+static void test_init(void)
+{
+	struct drr_flow flow;
+	drr_init(&flow, 3, UNIT);
+	CHECK(flow.quantum == 3 * UNIT);
+	CHECK(flow.deficit == 0);
+	drr_init(&flow, 0, UNIT);
+	CHECK(flow.quantum == UNIT);
+	drr_init(&flow, -2, UNIT);
+	CHECK(flow.quantum == UNIT);
+}
+
+static void test_arithmetic(void)
+{
+	struct drr_flow flow;
+	drr_init(&flow, 1, UNIT);
+	CHECK(drr_allowance(&flow, 1000) == 0);
+	drr_grant(&flow);
+	CHECK(flow.deficit == UNIT);
+	CHECK(drr_allowance(&flow, 1000) == 1000);
+	CHECK(drr_allowance(&flow, UNIT + 1) == UNIT);
+	drr_charge(&flow, 1000);
+	CHECK(flow.deficit == UNIT - 1000);
+	// sending more than the allowance must not wrap around
+	drr_charge(&flow, UNIT);
+	CHECK(flow.deficit == 0);
+	drr_grant(&flow);
+	drr_grant(&flow);
+	drr_grant(&flow);
+	drr_carry(&flow);
+	CHECK(flow.deficit == UNIT);
+	drr_reset(&flow);
+	CHECK(flow.deficit == 0);
+}
+
+// One scheduler visit of an always backlogged flow that sends at most
+// SEGMENT bytes at a time, as connection_tx_serve() does
+static uint64_t serve(struct drr_flow *flow)
+{
+	uint64_t sent = 0;
+	drr_grant(flow);
+	while(flow->deficit > 0) {
+		uint32_t len = drr_allowance(flow, SEGMENT);
+		drr_charge(flow, len);
+		sent += len;
+	}
+	drr_carry(flow);
+	return sent;
+}
+
+static void test_weights(void)
+{
+	struct drr_flow a, b;
+	uint64_t sent_a = 0, sent_b = 0;
+	int round;
+	drr_init(&a, 1, UNIT);
+	drr_init(&b, 3, UNIT);
+	for(round = 0; round < 100; round++) {
+		sent_a += serve(&a);
+		sent_b += serve(&b);
+		// the deficit must not grow across rounds
+		CHECK(a.deficit <= a.quantum);
+		CHECK(b.deficit <= b.quantum);
+	}
+	CHECK(sent_a == 100 * (uint64_t)UNIT);
+	CHECK(sent_b == 3 * sent_a);
+}
+
+int main(void)
+{
+	test_init();
+	test_arithmetic();
+	test_weights();
+	return failures ? 1 : 0;
+}
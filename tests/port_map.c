@@ -0,0 +1,111 @@
+/*
+ * port_map.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void test_parse(void)
+{
+	struct port_map map;
+	port_map_parse(&map, "62078:0,1234:2");
+	CHECK(map.count == 2);
+	CHECK(port_map_get(&map, 62078, 7) == 0);
+	CHECK(port_map_get(&map, 1234, 7) == 2);
+	CHECK(port_map_get(&map, 22, 7) == 7);
+	port_map_free(&map);
+	CHECK(map.count == 0);
+	CHECK(map.entries == NULL);
+}
+
+static void test_empty(void)
+{
+	struct port_map map;
+	port_map_parse(&map, NULL);
+	CHECK(map.count == 0);
+	CHECK(port_map_get(&map, 62078, 5) == 5);
+	port_map_free(&map);
+	port_map_parse(&map, "");
+	CHECK(map.count == 0);
+	port_map_free(&map);
+}
+
+static void test_malformed(void)
+{
+	struct port_map map;
+	// every entry but 80:5 and 90:-1 is skipped
+	port_map_parse(&map, "abc,80:5,70000:1,0:4,:3,100:,22:x,90:-1");
+	CHECK(map.count == 2);
+	CHECK(port_map_get(&map, 80, 0) == 5);
+	CHECK(port_map_get(&map, 90, 0) == -1);
+	CHECK(port_map_get(&map, 100, 0) == 0);
+	CHECK(port_map_get(&map, 22, 0) == 0);
+	port_map_free(&map);
+
+	port_map_parse(&map, "80:5,");
+	CHECK(map.count == 1);
+	port_map_free(&map);
+}
+
+static void test_first_match(void)
+{
+	struct port_map map;
+	port_map_parse(&map, "80:1,80:2");
+	CHECK(map.count == 2);
+	CHECK(port_map_get(&map, 80, 0) == 1);
+	port_map_free(&map);
+}
+
+static void test_getenv(void)
+{
+	setenv("USBMUXD_TEST_TUNABLE", "250", 1);
+	CHECK(getenv_int("USBMUXD_TEST_TUNABLE", 1) == 250);
+	CHECK(getenv_uint("USBMUXD_TEST_TUNABLE", 1) == 250);
+	setenv("USBMUXD_TEST_TUNABLE", "-5", 1);
+	CHECK(getenv_int("USBMUXD_TEST_TUNABLE", 1) == -5);
+	CHECK(getenv_uint("USBMUXD_TEST_TUNABLE", 1) == 1);
+	setenv("USBMUXD_TEST_TUNABLE", "12ms", 1);
+	CHECK(getenv_int("USBMUXD_TEST_TUNABLE", 1) == 1);
+	CHECK(getenv_uint("USBMUXD_TEST_TUNABLE", 1) == 1);
+	unsetenv("USBMUXD_TEST_TUNABLE");
+	CHECK(getenv_uint("USBMUXD_TEST_TUNABLE", 3) == 3);
+}
+
+int main(void)
+{
+	test_parse();
+	test_empty();
+	test_malformed();
+	test_first_match();
+	test_getenv();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * ratelimit.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ratelimit.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+
+static void test_init(void)
+{
+	struct token_bucket tb;
+	rate_init(&tb, 1000000);
+	CHECK(tb.burst == 1000000 * RATE_BURST_MS / 1000);
+	CHECK(tb.tokens == tb.burst);
+	rate_init(&tb, 1000);
+	CHECK(tb.burst == RATE_BURST_MIN);
+	CHECK(tb.tokens == RATE_BURST_MIN);
+}
+
+static void test_unlimited(void)
+{
+	struct token_bucket tb;
+	rate_init(&tb, 0);
+	rate_consume(&tb, 100000);
+	CHECK(rate_available(&tb, tb.last_refill + 1) == INT64_MAX);
+	CHECK(rate_wait(&tb) == 0);
+}
+
+static void test_refill(void)
+{
+	struct token_bucket tb;
+	rate_init(&tb, 1000);
+	tb.tokens = 0;
+	tb.last_refill = 1000000;
+	CHECK(rate_available(&tb, 1500000) == 500);
+	CHECK(tb.last_refill == 1500000);
+	// never more than the burst
+	CHECK(rate_available(&tb, 60000000) == RATE_BURST_MIN);
+}
+
+static void test_fractional_refill(void)
+{
+	struct token_bucket tb;
+	rate_init(&tb, 3);
+	tb.tokens = 0;
+	tb.last_refill = 0;
+	// 1.5 tokens: one is added, the time for the other half is kept
+	CHECK(rate_available(&tb, 500000) == 1);
+	CHECK(tb.last_refill == 333333);
+	CHECK(rate_available(&tb, 1000000) == 3);
+	// polling more often than a token takes must not lose time
+	tb.tokens = 0;
+	tb.last_refill = 2000000;
+	uint64_t now;
+	for(now = 2000000; now <= 3000000; now += 1000)
+		rate_available(&tb, now);
+	CHECK(tb.tokens == 3);
+}
+
+static void test_debt(void)
+{
+	struct token_bucket tb;
+	rate_init(&tb, 1000);
+	tb.last_refill = 1000000;
+	rate_consume(&tb, RATE_BURST_MIN + 999);
+	CHECK(rate_available(&tb, 1000000) == -999);
+	CHECK(rate_wait(&tb) == 1000000);
+	tb.tokens = 0;
+	CHECK(rate_wait(&tb) == 1000);
+	tb.tokens = 1;
+	CHECK(rate_wait(&tb) == 0);
+}
+
+int main(void)
+{
+	test_init();
+	test_unlimited();
+	test_refill();
+	test_fractional_refill();
+	test_debt();
+	return failures ? 1 : 0;
+}